@@ -0,0 +1,232 @@
+#ifndef ACCOUNTING_CPP
+#define ACCOUNTING_CPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// memory accounting for Mat storage. every block carries the tag that was current on the
+// allocating thread, an (owner, role) pair such as ("3 ConvLayer", WEIGHTS). live and peak
+// bytes and allocation counts are kept per tag, per role and in total, and step() closes a
+// high-water mark window, Network calls it once per update. allocations on pool workers
+// and outside any Scope land on the untagged ("-", OTHER) entry
+namespace accounting {
+
+enum Role {
+    WEIGHTS,
+    GRADIENTS,
+    ACTIVATIONS,
+    SCRATCH,
+    OTHER,
+    ROLES
+};
+
+static const char* role_names[ROLES] = { "weights", "gradients", "activations", "scratch", "other" };
+
+struct Stats {
+    atomic<long> live { 0 }, peak { 0 }, allocations { 0 };
+    atomic<long> step_peak { 0 }, last_step_peak { 0 };
+
+    void add(long bytes)
+    {
+        long now = live += bytes;
+        if (bytes > 0)
+            allocations++;
+        raise(peak, now);
+        raise(step_peak, now);
+    }
+
+    static void raise(atomic<long>& peak, long value)
+    {
+        long current = peak;
+        while (value > current && !peak.compare_exchange_weak(current, value)) {
+        }
+    }
+};
+
+// tags are never freed, so their stats can be indexed without a lock
+static const int max_tags = 4096;
+
+struct Registry {
+    Stats tags[max_tags], roles[ROLES], total;
+    Role role[max_tags] = {}; // of every tag, readable without the lock
+    mutex lock;
+    vector<pair<string, Role>> names { { "-", OTHER } };
+    map<pair<string, Role>, int> ids { { { "-", OTHER }, 0 } };
+};
+
+static Registry& registry()
+{
+    static Registry r;
+    return r;
+}
+
+// id of the (owner, role) tag, created on first use. tag 0 once the table is full
+static int tag(string owner, Role role)
+{
+    Registry& r = registry();
+    lock_guard<mutex> guard(r.lock);
+    auto it = r.ids.find({ owner, role });
+    if (it != r.ids.end())
+        return it->second;
+    if (r.names.size() == max_tags)
+        return 0;
+    r.role[r.names.size()] = role;
+    r.names.push_back({ owner, role });
+    return r.ids[{ owner, role }] = r.names.size() - 1;
+}
+
+static int& current()
+{
+    thread_local int id = 0;
+    return id;
+}
+
+// makes id the tag of allocations on this thread until destroyed
+class Scope {
+    int previous;
+
+public:
+    Scope(int id)
+        : previous(current())
+    {
+        current() = id;
+    }
+
+    ~Scope()
+    {
+        current() = previous;
+    }
+};
+
+struct alignas(max_align_t) Header {
+    int tag;
+    long bytes;
+};
+
+static void count(int id, long bytes)
+{
+    Registry& r = registry();
+    r.tags[id].add(bytes);
+    r.roles[r.role[id]].add(bytes);
+    r.total.add(bytes);
+}
+
+static void* acquire(size_t bytes)
+{
+    Header* header = (Header*)malloc(sizeof(Header) + bytes);
+    if (!header)
+        throw bad_alloc();
+    header->tag = current();
+    header->bytes = bytes;
+    count(header->tag, bytes);
+    return header + 1;
+}
+
+static void release(void* p)
+{
+    Header* header = (Header*)p - 1;
+    count(header->tag, -header->bytes);
+    free(header);
+}
+
+// moves a block and its bytes to another tag, for storage whose role is only known after it exists
+static void retag(void* p, int id)
+{
+    Header* header = (Header*)p - 1;
+    if (header->tag == id)
+        return;
+    Registry& r = registry();
+    r.tags[header->tag].live -= header->bytes;
+    r.tags[header->tag].allocations--;
+    r.roles[r.role[header->tag]].live -= header->bytes;
+    r.roles[r.role[header->tag]].allocations--;
+    header->tag = id;
+    r.tags[id].live += header->bytes;
+    r.tags[id].allocations++;
+    r.roles[r.role[id]].live += header->bytes;
+    r.roles[r.role[id]].allocations++;
+    Stats::raise(r.tags[id].peak, r.tags[id].live);
+    Stats::raise(r.tags[id].step_peak, r.tags[id].live);
+    Stats::raise(r.roles[r.role[id]].peak, r.roles[r.role[id]].live);
+    Stats::raise(r.roles[r.role[id]].step_peak, r.roles[r.role[id]].live);
+}
+
+template <class T>
+struct Allocator {
+    typedef T value_type;
+
+    Allocator() { }
+    template <class U>
+    Allocator(const Allocator<U>&) { }
+
+    T* allocate(size_t n) { return (T*)acquire(n * sizeof(T)); }
+    void deallocate(T* p, size_t) { release(p); }
+
+    template <class U>
+    bool operator==(const Allocator<U>&) const { return true; }
+    template <class U>
+    bool operator!=(const Allocator<U>&) const { return false; }
+};
+
+// starts a new high-water mark window, the one just closed is reported as the last step
+static void step()
+{
+    Registry& r = registry();
+    auto close = [](Stats& s) {
+        s.last_step_peak = s.step_peak.load();
+        s.step_peak = s.live.load();
+    };
+    int n;
+    {
+        lock_guard<mutex> guard(r.lock);
+        n = r.names.size();
+    }
+    for (int i = 0; i < n; i++) {
+        close(r.tags[i]);
+    }
+    for (auto& s : r.roles) {
+        close(s);
+    }
+    close(r.total);
+}
+
+static inline long live() { return registry().total.live; }
+static inline long peak() { return registry().total.peak; }
+static inline long allocations() { return registry().total.allocations; }
+
+// bytes per role and in total, then per tag that ever allocated
+static void report(ostream& os)
+{
+    Registry& r = registry();
+    lock_guard<mutex> guard(r.lock);
+    auto line = [&](string owner, string role, Stats& s) {
+        os << left << setw(24) << owner << setw(13) << role << right << setw(13) << s.live << setw(13) << s.peak
+           << setw(13) << s.last_step_peak << setw(11) << s.allocations << '\n';
+    };
+    os << left << setw(24) << "owner" << setw(13) << "role" << right << setw(13) << "live" << setw(13) << "peak"
+       << setw(13) << "step peak" << setw(11) << "allocs" << '\n';
+    for (int role = 0; role < ROLES; role++) {
+        if (r.roles[role].allocations > 0)
+            line("*", role_names[role], r.roles[role]);
+    }
+    line("*", "total", r.total);
+    for (int i = 0; i < r.names.size(); i++) {
+        if (r.tags[i].allocations > 0)
+            line(r.names[i].first, role_names[r.names[i].second], r.tags[i]);
+    }
+}
+
+}
+
+#endif
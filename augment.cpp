@@ -0,0 +1,237 @@
+#ifndef AUGMENT_CPP
+#define AUGMENT_CPP
+
+#include "mutil.cpp"
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+using namespace mutil;
+
+// ranges of the random transform, 0 turns a part off
+struct AugmentConfig {
+    float shift = 2; // pixels, uniform in [-shift, shift] on each axis
+    float rotation = 0.15f; // radians, uniform in [-rotation, rotation] around the centre
+    float elastic = 0; // pixels of smooth random displacement
+    int elastic_grid = 4; // control points per axis the displacement is interpolated from
+    float noise = 0; // standard deviation of gaussian pixel noise, in [0, 1] units
+};
+
+static inline float byte_at(const uint8_t* src, int height, int width, int x, int y)
+{
+    return x >= 0 && y >= 0 && x < width && y < height ? src[y * width + x] : 0;
+}
+
+// out[i] = src bilinearly sampled at (xs[i], ys[i]) and scaled to [0, 1], zero outside the image
+void bilinear_row(const uint8_t* src, int height, int width, const float* xs, const float* ys, int n, float* out)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 one = _mm_set1_ps(1), scale = _mm_set1_ps(1 / 255.0f);
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_loadu_ps(xs + i), y = _mm_loadu_ps(ys + i);
+        // floor, truncation rounds negative coordinates up
+        __m128 x0 = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+        __m128 y0 = _mm_cvtepi32_ps(_mm_cvttps_epi32(y));
+        x0 = _mm_sub_ps(x0, _mm_and_ps(_mm_cmplt_ps(x, x0), one));
+        y0 = _mm_sub_ps(y0, _mm_and_ps(_mm_cmplt_ps(y, y0), one));
+        __m128 fx = _mm_sub_ps(x, x0), fy = _mm_sub_ps(y, y0);
+        alignas(16) int xi[4], yi[4];
+        _mm_store_si128((__m128i*)xi, _mm_cvttps_epi32(x0));
+        _mm_store_si128((__m128i*)yi, _mm_cvttps_epi32(y0));
+        __m128 p00 = _mm_setr_ps(byte_at(src, height, width, xi[0], yi[0]), byte_at(src, height, width, xi[1], yi[1]), byte_at(src, height, width, xi[2], yi[2]), byte_at(src, height, width, xi[3], yi[3]));
+        __m128 p10 = _mm_setr_ps(byte_at(src, height, width, xi[0] + 1, yi[0]), byte_at(src, height, width, xi[1] + 1, yi[1]), byte_at(src, height, width, xi[2] + 1, yi[2]), byte_at(src, height, width, xi[3] + 1, yi[3]));
+        __m128 p01 = _mm_setr_ps(byte_at(src, height, width, xi[0], yi[0] + 1), byte_at(src, height, width, xi[1], yi[1] + 1), byte_at(src, height, width, xi[2], yi[2] + 1), byte_at(src, height, width, xi[3], yi[3] + 1));
+        __m128 p11 = _mm_setr_ps(byte_at(src, height, width, xi[0] + 1, yi[0] + 1), byte_at(src, height, width, xi[1] + 1, yi[1] + 1), byte_at(src, height, width, xi[2] + 1, yi[2] + 1), byte_at(src, height, width, xi[3] + 1, yi[3] + 1));
+        __m128 top = _mm_add_ps(p00, _mm_mul_ps(fx, _mm_sub_ps(p10, p00)));
+        __m128 bottom = _mm_add_ps(p01, _mm_mul_ps(fx, _mm_sub_ps(p11, p01)));
+        __m128 res = _mm_add_ps(top, _mm_mul_ps(fy, _mm_sub_ps(bottom, top)));
+        _mm_storeu_ps(out + i, _mm_mul_ps(res, scale));
+    }
+#endif
+    for (; i < n; i++) {
+        float x0 = floor(xs[i]), y0 = floor(ys[i]);
+        float fx = xs[i] - x0, fy = ys[i] - y0;
+        int xi = x0, yi = y0;
+        float top = byte_at(src, height, width, xi, yi) + fx * (byte_at(src, height, width, xi + 1, yi) - byte_at(src, height, width, xi, yi));
+        float bottom = byte_at(src, height, width, xi, yi + 1) + fx * (byte_at(src, height, width, xi + 1, yi + 1) - byte_at(src, height, width, xi, yi + 1));
+        out[i] = (top + fy * (bottom - top)) * (1 / 255.0f);
+    }
+}
+
+// random shift, rotation, elastic distortion and noise of one image into out, channels x (height * width)
+void augment(ByteImage& img, AugmentConfig& config, default_random_engine& e, Mat& out)
+{
+    uniform_real_distribution<float> unit(-1, 1);
+    int height = img.height, width = img.width, grid = max(2, config.elastic_grid);
+    float angle = config.rotation * unit(e);
+    float dx = config.shift * unit(e), dy = config.shift * unit(e);
+    vector<float> gx(grid * grid), gy(grid * grid);
+    for (int i = 0; i < grid * grid; i++) {
+        gx[i] = config.elastic * unit(e);
+        gy[i] = config.elastic * unit(e);
+    }
+    float c = cos(angle), s = sin(angle);
+    float cx = (width - 1) / 2.0f, cy = (height - 1) / 2.0f;
+    out = Mat(img.channels, height * width);
+    vector<float> xs(width), ys(width);
+    for (int y = 0; y < height; y++) {
+        // inverse mapping: the output pixel samples the source point rotated back around the centre
+        for (int x = 0; x < width; x++) {
+            float u = x - cx - dx, v = y - cy - dy;
+            xs[x] = c * u + s * v + cx;
+            ys[x] = -s * u + c * v + cy;
+        }
+        if (config.elastic > 0) {
+            float py = (float)y / max(height - 1, 1) * (grid - 1);
+            int r = min((int)py, grid - 2);
+            float fy = py - r;
+            for (int x = 0; x < width; x++) {
+                float px = (float)x / max(width - 1, 1) * (grid - 1);
+                int q = min((int)px, grid - 2);
+                float fx = px - q;
+                int k = r * grid + q;
+                xs[x] += (1 - fy) * ((1 - fx) * gx[k] + fx * gx[k + 1]) + fy * ((1 - fx) * gx[k + grid] + fx * gx[k + grid + 1]);
+                ys[x] += (1 - fy) * ((1 - fx) * gy[k] + fx * gy[k + 1]) + fy * ((1 - fx) * gy[k + grid] + fx * gy[k + grid + 1]);
+            }
+        }
+        for (int ch = 0; ch < img.channels; ch++) {
+            bilinear_row(img.channel(ch), height, width, xs.data(), ys.data(), width, &*(out[ch] + y * width));
+        }
+    }
+    if (config.noise > 0) {
+        normal_distribution<float> noise(0, config.noise);
+        auto val = out[0];
+        for (int i = 0; i < img.channels * height * width; i++) {
+            val[i] = min(1.0f, max(0.0f, val[i] + noise(e)));
+        }
+    }
+}
+
+// produces shuffled, augmented, one-hot labelled batches on worker threads, up to prefetch
+// batches ahead of the consumer. sample i of epoch k always gets the random stream seeded
+// with (seed, k, i), so the batches don't depend on the thread count or timing
+class Augmenter {
+    vector<ByteImage> images;
+    vector<int> labels;
+    int classes, batch_size, prefetch;
+    unsigned seed;
+    vector<thread> workers;
+    mutex lock;
+    condition_variable cv;
+    map<int, vector<pair<Mat, Mat>>> ready;
+    vector<int> order;
+    int batches = 0, claimed = 0, consumed = 0, busy = 0;
+    bool stop = false;
+
+public:
+    AugmentConfig config;
+    int epoch = -1;
+
+    Augmenter(vector<ByteImage> images, vector<int> labels, int classes, AugmentConfig config, int batch_size, unsigned seed = 0, int threads = 2, int prefetch = 16)
+        : images(move(images))
+        , labels(move(labels))
+        , classes(classes)
+        , batch_size(batch_size)
+        , prefetch(prefetch)
+        , seed(seed)
+        , config(config)
+    {
+        for (int i = 0; i < threads; i++) {
+            workers.emplace_back([this] { run(); });
+        }
+    }
+
+    ~Augmenter()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // reshuffles and starts producing the batches of the given epoch
+    void start(int epoch)
+    {
+        unique_lock<mutex> guard(lock);
+        cv.wait(guard, [this] { return busy == 0; });
+        this->epoch = epoch;
+        order = vector<int>(images.size());
+        iota(order.begin(), order.end(), 0);
+        seed_seq seq { seed, (unsigned)epoch };
+        default_random_engine e(seq);
+        shuffle(order.begin(), order.end(), e);
+        ready.clear();
+        batches = (images.size() + batch_size - 1) / batch_size;
+        claimed = consumed = 0;
+        cv.notify_all();
+    }
+
+    // the next batch of the epoch, false at its end. the following call continues with the next epoch
+    bool next(vector<pair<Mat, Mat>>& batch)
+    {
+        if (epoch < 0)
+            start(0);
+        unique_lock<mutex> guard(lock);
+        if (consumed == batches) {
+            guard.unlock();
+            start(epoch + 1);
+            return false;
+        }
+        cv.wait(guard, [this] { return ready.count(consumed) > 0; });
+        batch = move(ready[consumed]);
+        ready.erase(consumed++);
+        cv.notify_all();
+        return true;
+    }
+
+    // batch source for Network::train
+    function<bool(vector<pair<Mat, Mat>>&)> source()
+    {
+        return [this](vector<pair<Mat, Mat>>& batch) { return next(batch); };
+    }
+
+private:
+    void run()
+    {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            cv.wait(guard, [this] { return stop || (claimed < batches && claimed < consumed + prefetch); });
+            if (stop)
+                return;
+            int index = claimed++, epoch = this->epoch;
+            busy++;
+            guard.unlock();
+            vector<pair<Mat, Mat>> batch;
+            for (int i = index * batch_size; i < min<int>(images.size(), (index + 1) * batch_size); i++) {
+                seed_seq seq { seed, (unsigned)epoch, (unsigned)i };
+                default_random_engine e(seq);
+                Mat label(1, classes);
+                label[0][labels[order[i]]] = 1;
+                batch.push_back({ Mat(), label });
+                augment(images[order[i]], config, e, batch.back().first);
+            }
+            guard.lock();
+            ready[index] = move(batch);
+            busy--;
+            cv.notify_all();
+        }
+    }
+};
+
+#endif
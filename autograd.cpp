@@ -0,0 +1,294 @@
+#ifndef AUTOGRAD_CPP
+#define AUTOGRAD_CPP
+
+#include "mutil.cpp"
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace mutil;
+
+namespace autograd {
+
+struct Node {
+    string op;
+    vector<int> inputs;
+    Mat value, grad;
+    Mat* ref = nullptr; // leaves point at the caller's Mat instead of copying it
+    Mat* delta = nullptr; // parameters receive their gradient here
+    function<void(Node&)> backward;
+};
+
+// reverse-mode tape: ops are recorded in execution order during forward, backward
+// replays them in reverse and releases every intermediate as soon as it is consumed.
+// nodes stays inspectable between forward and backward for fusion or memory planning
+class Tape {
+
+public:
+    vector<Node> nodes;
+
+    void clear()
+    {
+        nodes.clear();
+    }
+
+    Mat& value(int v)
+    {
+        return nodes[v].ref ? *nodes[v].ref : nodes[v].value;
+    }
+
+    Mat& grad(int v)
+    {
+        return nodes[v].grad;
+    }
+
+    // referenced Mats must stay alive until backward
+    int input(Mat& in)
+    {
+        Node node;
+        node.op = "input";
+        node.ref = &in;
+        return push(node);
+    }
+
+    int param(Mat& w, Mat& delta)
+    {
+        Node node;
+        node.op = "param";
+        node.ref = &w;
+        node.delta = &delta;
+        return push(node);
+    }
+
+    int matmul(int a, int b)
+    {
+        Node node = make("matmul", { a, b }, value(a) * value(b));
+        node.backward = [this, a, b](Node& n) {
+            accumulate(a, n.grad * value(b).transpose());
+            accumulate(b, value(a).transpose() * n.grad);
+        };
+        return push(node);
+    }
+
+    // b is broadcast when it is a single row or a single column
+    int add(int a, int b)
+    {
+        Mat res = value(a);
+        Mat& other = value(b);
+        for (int i = 0; i < res.size.first; i++) {
+            for (int j = 0; j < res.size.second; j++) {
+                res[i][j] += other[other.size.first == 1 ? 0 : i][other.size.second == 1 ? 0 : j];
+            }
+        }
+        Node node = make("add", { a, b }, res);
+        node.backward = [this, a, b](Node& n) {
+            accumulate(a, n.grad);
+            pair<int, int> size = value(b).size;
+            Mat g(size.first, size.second);
+            for (int i = 0; i < n.grad.size.first; i++) {
+                for (int j = 0; j < n.grad.size.second; j++) {
+                    g[size.first == 1 ? 0 : i][size.second == 1 ? 0 : j] += n.grad[i][j];
+                }
+            }
+            accumulate(b, g);
+        };
+        return push(node);
+    }
+
+    int mul(int a, int b)
+    {
+        Mat res = value(a);
+        Node node = make("mul", { a, b }, res.dot(value(b)));
+        node.backward = [this, a, b](Node& n) {
+            Mat ga = n.grad, gb = n.grad;
+            accumulate(a, ga.dot(value(b)));
+            accumulate(b, gb.dot(value(a)));
+        };
+        return push(node);
+    }
+
+    int sigmoid(int a)
+    {
+        Mat res = value(a);
+        Node node = make("sigmoid", { a }, mutil::sigmoid(res));
+        node.backward = [this, a](Node& n) {
+            Mat g = n.grad;
+            for (int i = 0; i < g.size.first; i++) {
+                for (int j = 0; j < g.size.second; j++) {
+                    g[i][j] *= n.value[i][j] * (1 - n.value[i][j]);
+                }
+            }
+            accumulate(a, g);
+        };
+        return push(node);
+    }
+
+    int tanh(int a)
+    {
+        Mat res = value(a);
+        Node node = make("tanh", { a }, mutil::tanh(res));
+        node.backward = [this, a](Node& n) {
+            Mat g = n.grad;
+            for (int i = 0; i < g.size.first; i++) {
+                for (int j = 0; j < g.size.second; j++) {
+                    g[i][j] *= 1 - n.value[i][j] * n.value[i][j];
+                }
+            }
+            accumulate(a, g);
+        };
+        return push(node);
+    }
+
+    int relu(int a)
+    {
+        Mat res = value(a);
+        Node node = make("relu", { a }, mutil::relu(res));
+        node.backward = [this, a](Node& n) {
+            Mat g = n.grad;
+            for (int i = 0; i < g.size.first; i++) {
+                for (int j = 0; j < g.size.second; j++) {
+                    g[i][j] *= n.value[i][j] > 0 ? 1 : 0;
+                }
+            }
+            accumulate(a, g);
+        };
+        return push(node);
+    }
+
+    int concat(int a, int b)
+    {
+        Node node = make("concat", { a, b }, mutil::concat(value(a), value(b)));
+        node.backward = [this, a, b](Node& n) {
+            int split = value(a).size.second;
+            accumulate(a, columns(n.grad, 0, split));
+            accumulate(b, columns(n.grad, split, n.grad.size.second));
+        };
+        return push(node);
+    }
+
+    // columns [begin, end) of a
+    int slice(int a, int begin, int end)
+    {
+        Node node = make("slice", { a }, columns(value(a), begin, end));
+        node.backward = [this, a, begin, end](Node& n) {
+            pair<int, int> size = value(a).size;
+            Mat g(size.first, size.second);
+            for (int i = 0; i < size.first; i++) {
+                copy(n.grad[i], n.grad[i] + (end - begin), g[i] + begin);
+            }
+            accumulate(a, g);
+        };
+        return push(node);
+    }
+
+    // a is channels x (height * width), the result (channels * kh * kw) x (out_h * out_w)
+    // so that a convolution is matmul(w, im2col(x)) with w of kernel_count x (channels * kh * kw)
+    int im2col(int a, int channels, int height, int width, pair<int, int> ksize, int stride, int padding)
+    {
+        pair<int, int> out = mutil::compute_output_size(height, width, ksize.first, ksize.second, stride, padding);
+        Mat res(channels * ksize.first * ksize.second, out.first * out.second);
+        mutil::im2col(value(a), channels, height, width, ksize, stride, padding, res);
+        Node node = make("im2col", { a }, res);
+        node.backward = [this, a, channels, height, width, ksize, stride, padding](Node& n) {
+            Mat g(channels, height * width);
+            mutil::col2im(n.grad, channels, height, width, ksize, stride, padding, g);
+            accumulate(a, g);
+        };
+        return push(node);
+    }
+
+    int max_pool(int a, int channels, int height, int width, pair<int, int> size, int stride)
+    {
+        pair<int, int> out = mutil::compute_output_size(height, width, size.first, size.second, stride, 0);
+        Mat res(channels, out.first * out.second);
+        for (int c = 0; c < channels; c++) {
+            Kernel img(height, width, value(a)[c]);
+            Kernel dst(out.first, out.second, res[c]);
+            mutil::max_pooling(img, dst, size, stride);
+        }
+        Node node = make("max_pool", { a }, res);
+        node.backward = [this, a, channels, height, width, size, stride, out](Node& n) mutable {
+            Mat g(channels, height * width);
+            for (int c = 0; c < channels; c++) {
+                Kernel img(height, width, value(a)[c]);
+                Kernel delta(out.first, out.second, n.grad[c]);
+                Kernel dst(height, width, g[c]);
+                mutil::max_pooling_prime(img, delta, dst, size, stride);
+            }
+            accumulate(a, g);
+        };
+        return push(node);
+    }
+
+    // wraps a hand-written forward/backward pair, e.g. an existing layer
+    int custom(string op, int a, function<Mat(Mat&)> f, function<Mat(Mat&)> df)
+    {
+        Mat res = value(a);
+        Node node = make(op, { a }, f(res));
+        node.backward = [this, a, df](Node& n) {
+            accumulate(a, df(n.grad));
+        };
+        return push(node);
+    }
+
+    // propagates grad from out back to every node, parameters get their gradient in delta
+    void backward(int out, Mat& grad)
+    {
+        for (auto& node : nodes) {
+            node.grad = Mat();
+        }
+        nodes[out].grad = grad;
+        for (int i = out; i >= 0; i--) {
+            Node& node = nodes[i];
+            if (node.delta) {
+                if (node.grad.size.first)
+                    *node.delta = node.grad;
+                else
+                    node.delta->clear();
+            }
+            if (node.ref)
+                continue;
+            if (node.grad.size.first && node.backward)
+                node.backward(node);
+            node.value = Mat();
+            node.grad = Mat();
+        }
+    }
+
+private:
+    Node make(string op, vector<int> inputs, Mat value)
+    {
+        Node node;
+        node.op = op;
+        node.inputs = inputs;
+        node.value = value;
+        return node;
+    }
+
+    int push(Node& node)
+    {
+        nodes.push_back(node);
+        return nodes.size() - 1;
+    }
+
+    void accumulate(int v, Mat g)
+    {
+        if (nodes[v].grad.size.first)
+            nodes[v].grad += g;
+        else
+            nodes[v].grad = g;
+    }
+
+    static Mat columns(Mat& in, int begin, int end)
+    {
+        Mat res(in.size.first, end - begin);
+        for (int i = 0; i < in.size.first; i++) {
+            copy(in[i] + begin, in[i] + end, res[i]);
+        }
+        return res;
+    }
+};
+
+}
+
+#endif
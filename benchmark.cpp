@@ -0,0 +1,295 @@
+// end-to-end regression benchmark, built on its own:
+//   g++ -std=c++17 -O3 benchmark.cpp -o benchmark -pthread
+//   ./benchmark [--batches 300] [--images 2000] [--data mnist-t10k] [--baseline bench_baseline.json]
+//               [--threshold 0.15] [--save bench_baseline.json] [--perf 1, defaults to CPPNN_PERF]
+// trains the LeNet5 configuration of main.cpp for a fixed number of batches, at a learning rate
+// that converges within the default 300, runs test set inference, prints the metrics as JSON and
+// compares them against the baseline. the exit status is 1 when a metric is more than threshold
+// worse than its baseline value, or when a ConvLayer backward path fails its gradient check,
+// which runs before anything is timed. timing, memory and allocation numbers are only comparable on
+// the host that recorded the baseline. --perf 1 adds the per layer and kernel counters of
+// perf.cpp on stderr, at the cost of comparable numbers
+#include "dataset.cpp"
+#include "network.cpp"
+#include "optimizer.cpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#define endl '\n'
+using namespace std;
+using namespace mutil;
+
+// everything but Mat storage, which accounting counts
+static atomic<long> allocations { 0 };
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// kilobytes on Linux, 0 where getrusage isn't available
+static long peak_rss_kb()
+{
+#ifndef _WIN32
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#else
+    return 0;
+#endif
+}
+
+static double seconds_since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// seeded stand-in for MNIST when no cache is given: a noisy bar per class, so the
+// workload and the numbers don't depend on files being present
+static vector<pair<Mat, Mat>> synthetic(int n, unsigned seed)
+{
+    default_random_engine e(seed);
+    uniform_real_distribution<float> noise(0, 0.3f);
+    vector<pair<Mat, Mat>> data;
+    for (int i = 0; i < n; i++) {
+        Mat in(1, 28 * 28), ans(1, 10);
+        int label = i % 10;
+        for (int y = 0; y < 28; y++) {
+            for (int x = 0; x < 28; x++) {
+                in[0][y * 28 + x] = noise(e) + (x / 3 == label ? 0.7f : 0);
+            }
+        }
+        ans[0][label] = 1;
+        data.push_back({ in, ans });
+    }
+    return data;
+}
+
+// flat {"name": number, ...} object as written by write_json, string values are skipped
+static map<string, double> read_json(string path)
+{
+    map<string, double> res;
+    ifstream fin(path);
+    string text((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+    for (size_t pos = text.find('"'); pos != string::npos; pos = text.find('"', pos)) {
+        size_t end = text.find('"', pos + 1), colon = text.find(':', end);
+        if (end == string::npos || colon == string::npos)
+            break;
+        size_t value = text.find_first_not_of(" \t\r\n", colon + 1);
+        if (value != string::npos && text[value] == '"') {
+            pos = text.find('"', value + 1);
+            if (pos == string::npos)
+                break;
+            pos = text.find_first_of(",}", pos);
+            continue;
+        }
+        res[text.substr(pos + 1, end - pos - 1)] = strtod(text.c_str() + colon + 1, nullptr);
+        pos = text.find_first_of(",}", colon);
+    }
+    return res;
+}
+
+// the throughputs, latencies, rss and allocation count depend on the machine and the
+// compiler, a baseline is only comparable on the host that recorded it
+static const char* baseline_note = "recorded on one host; throughput, latency, peak_rss_mb and allocs_per_step "
+                                   "only compare against runs on that host. re-record with --save elsewhere";
+
+static void write_json(ostream& out, vector<pair<string, double>>& metrics, string note = "")
+{
+    out << "{" << endl;
+    if (!note.empty())
+        out << "    \"note\": \"" << note << "\"," << endl;
+    for (int i = 0; i < metrics.size(); i++) {
+        out << "    \"" << metrics[i].first << "\": " << setprecision(6) << metrics[i].second << (i + 1 < metrics.size() ? "," : "") << endl;
+    }
+    out << "}" << endl;
+}
+
+// checks every ConvLayer backward path against finite differences: the explicit GEMMs, the
+// implicit GEMM and NHWC, with and without stride and padding. float round-off stays around
+// 1e-3, a wrong gradient is off by far more than tolerance
+static bool conv_gradients_ok(float tolerance = 1e-2f)
+{
+    const char* paths[] = { "explicit", "implicit", "nhwc" };
+    bool ok = true;
+    for (int path = 0; path < 3; path++) {
+        for (int geometry = 0; geometry < 2; geometry++) {
+            int stride = geometry ? 2 : 1, padding = geometry;
+            ConvLayer conv(3, 3, 4, stride, padding);
+            conv.build({ 3, 7, 7 });
+            conv.implicit_gemm = path == 1;
+            if (path == 2)
+                conv.setLayout(NHWC);
+            default_random_engine e(path * 2 + geometry);
+            conv.randomize(e);
+            uniform_real_distribution<float> uniform(-1, 1);
+            Mat in = path == 2 ? Mat(7 * 7, 3) : Mat(3, 7 * 7);
+            for (int i = 0; i < in.size.first; i++) {
+                for (int j = 0; j < in.size.second; j++) {
+                    in[i][j] = uniform(e);
+                }
+            }
+            float error = debug::gradcheck(conv, in);
+            if (!(error <= tolerance)) {
+                cerr << "gradient check failed, " << paths[path] << ", stride " << stride << ", padding " << padding
+                     << ": max relative error " << error << endl;
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    int batches = 300, images = 2000;
+    double threshold = 0.15;
+    bool counters = perf::requested();
+    string data_prefix, baseline = "bench_baseline.json", save;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string arg = argv[i];
+        if (arg == "--batches")
+            batches = atoi(argv[i + 1]);
+        else if (arg == "--images")
+            images = atoi(argv[i + 1]);
+        else if (arg == "--data")
+            data_prefix = argv[i + 1];
+        else if (arg == "--baseline")
+            baseline = argv[i + 1];
+        else if (arg == "--threshold")
+            threshold = atof(argv[i + 1]);
+        else if (arg == "--save")
+            save = argv[i + 1];
+        else if (arg == "--perf")
+            counters = atoi(argv[i + 1]);
+    }
+
+    if (!conv_gradients_ok())
+        return 1;
+
+    int batch_size = 10;
+    vector<pair<Mat, Mat>> train_data, test_data;
+    if (!data_prefix.empty()) {
+        DatasetCache cache(data_prefix);
+        for (int i = 0; i < min(cache.size(), max(batches * batch_size, images)); i++) {
+            train_data.push_back(cache[i]);
+        }
+        test_data.assign(train_data.begin(), train_data.begin() + min<int>(images, train_data.size()));
+    }
+    if (train_data.empty()) {
+        train_data = synthetic(batches * batch_size, 1);
+        test_data = synthetic(images, 2);
+    }
+
+    Network network({ new ConvLayer(5, 5, 6, 1, 0),
+                        new RELULayer(),
+                        new PoolingLayer({ 2, 2 }, 2),
+                        new ConvLayer(5, 5, 16, 1, 0),
+                        new RELULayer(),
+                        new PoolingLayer({ 2, 2 }, 2),
+                        new ConvLayer(4, 4, 120, 1, 0),
+                        new RELULayer(),
+                        new FlattenLayer(),
+                        new DenseLayer(84),
+                        new RELULayer(),
+                        new DenseLayer(10),
+                        new SoftmaxLayer() },
+        new SDG(0.1), batch_size, { 1, 28, 28 });
+    network.init(1);
+
+    // a few untimed batches so scratch buffers and the thread pool exist before measuring
+    int warmup = min(5, batches), index = 0, step = 0;
+    auto next = [&](vector<pair<Mat, Mat>>& batch) {
+        if (step == batches || index >= train_data.size())
+            return false;
+        batch.assign(train_data.begin() + index, train_data.begin() + min<int>(train_data.size(), index + batch_size));
+        index += batch_size, step++;
+        return true;
+    };
+    for (vector<pair<Mat, Mat>> batch; step < warmup && next(batch);) {
+        for (auto& sample : batch) {
+            network.backPropagation(network.forward(sample.first), sample.second);
+        }
+        network.update();
+    }
+    if (counters && !perf::enable())
+        cerr << "hardware counters unavailable, timings only" << endl;
+    int trained = index;
+    long allocated = allocations + accounting::allocations();
+    auto start = chrono::steady_clock::now();
+    network.train(next);
+    double train_seconds = seconds_since(start);
+    long steps = max(1, step - warmup);
+    double allocs_per_step = (allocations + accounting::allocations() - allocated) / (double)steps;
+    trained = index - trained;
+
+    vector<double> latency;
+    int correct = 0;
+    start = chrono::steady_clock::now();
+    for (auto& sample : test_data) {
+        auto begin = chrono::steady_clock::now();
+        Mat result = network.forward(sample.first);
+        latency.push_back(seconds_since(begin) * 1e6);
+        if (max_element(result[0], result[0] + 10) - result[0] == max_element(sample.second[0], sample.second[0] + 10) - sample.second[0])
+            correct++;
+    }
+    double infer_seconds = seconds_since(start);
+    sort(latency.begin(), latency.end());
+    auto percentile = [&](double p) { return latency.empty() ? 0 : latency[min<size_t>(latency.size() - 1, p * latency.size())]; };
+
+    vector<pair<string, double>> metrics = {
+        { "train_images_per_s", trained / train_seconds },
+        { "infer_images_per_s", test_data.size() / infer_seconds },
+        { "latency_p50_us", percentile(0.5) },
+        { "latency_p99_us", percentile(0.99) },
+        { "peak_rss_mb", peak_rss_kb() / 1024.0 },
+        { "allocs_per_step", allocs_per_step },
+        { "accuracy", correct / (double)max<size_t>(1, test_data.size()) },
+    };
+    write_json(cout, metrics);
+    perf::report(cerr);
+    if (!save.empty()) {
+        ofstream fout(save);
+        write_json(fout, metrics, baseline_note);
+    }
+
+    // throughputs must not drop, everything else must not grow. accuracy only tells
+    // whether the run is comparable and isn't judged
+    map<string, double> reference = read_json(baseline);
+    if (reference.empty()) {
+        cout << "no baseline at " << baseline << ", nothing compared" << endl;
+        return 0;
+    }
+    bool regressed = false;
+    for (auto& metric : metrics) {
+        if (!reference.count(metric.first) || metric.first == "accuracy" || reference[metric.first] <= 0)
+            continue;
+        bool higher_better = metric.first.size() > 6 && metric.first.substr(metric.first.size() - 6) == "_per_s";
+        double change = metric.second / reference[metric.first] - 1;
+        bool worse = higher_better ? change < -threshold : change > threshold;
+        cout << (worse ? "REGRESSION " : "ok         ") << setw(20) << left << metric.first << right
+             << fixed << setprecision(1) << showpos << change * 100 << "%" << noshowpos << defaultfloat << endl;
+        regressed |= worse;
+    }
+    return regressed ? 1 : 0;
+}
@@ -2,153 +2,218 @@
 #define BMP_LOADER_CPP
 
 #include "mutil.cpp"
+#include "threadpool.cpp"
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-struct BitmapFileHeader {
-    char type[2];
-    unsigned int size;
-    short reserved1;
-    short reserved2;
-    unsigned int offset;
+using namespace std;
+using namespace mutil;
 
-    friend ostream& operator<<(ostream& os, const BitmapFileHeader& header)
-    {
-        os << header.type[0] << header.type[1];
-        os << header.size;
-        os << header.reserved1;
-        os << header.reserved2;
-        os << header.offset;
-        return os;
+static inline uint32_t read_u32(const uint8_t* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint16_t read_u16(const uint8_t* p)
+{
+    return p[0] | p[1] << 8;
+}
+
+// decodes an uncompressed 8-bit palette, 24-bit or 32-bit BMP held in memory into a
+// 3 x height x width RGB image. rows are padded to 4 bytes and stored bottom-up unless
+// the height is negative. false if the data isn't a BMP we understand
+bool decodeBmp(const uint8_t* data, size_t size, ByteImage& img)
+{
+    if (size < 54 || data[0] != 'B' || data[1] != 'M')
+        return false;
+    uint32_t offset = read_u32(data + 10);
+    uint32_t header_size = read_u32(data + 14);
+    int32_t width = read_u32(data + 18), height = read_u32(data + 22);
+    int bit_count = read_u16(data + 28);
+    uint32_t compression = read_u32(data + 30), colors = read_u32(data + 46);
+    bool top_down = height < 0;
+    // BI_RGB, or BI_BITFIELDS with the usual BGRA masks, which follow the 40-byte header
+    bool bitfields = compression == 3 && bit_count == 32;
+    if (width <= 0 || height == 0 || height == INT32_MIN || (compression != 0 && !bitfields))
+        return false;
+    if (bitfields && (size < 66 || read_u32(data + 54) != 0x00ff0000 || read_u32(data + 58) != 0x0000ff00 || read_u32(data + 62) != 0x000000ff))
+        return false;
+    height = abs(height);
+    if (bit_count != 8 && bit_count != 24 && bit_count != 32)
+        return false;
+    // sizes from the header are compared in 64 bits or by division, they can't wrap
+    uint64_t stride = ((uint64_t)width * bit_count + 31) / 32 * 4;
+    if (offset > size || (size - offset) / stride < (uint64_t)height)
+        return false;
+    const uint8_t* palette = nullptr;
+    if (bit_count == 8) {
+        colors = colors ? colors : 256;
+        uint64_t palette_offset = 14 + (uint64_t)header_size;
+        if (palette_offset + 4 * (uint64_t)colors > offset)
+            return false;
+        palette = data + palette_offset;
     }
 
-    friend istream& operator>>(istream& is, BitmapFileHeader& header)
-    {
-        is >> header.type[0] >> header.type[1];
-        is.read((char*)&header.size, sizeof(header.size));
-        is.read((char*)&header.reserved1, sizeof(header.reserved1));
-        is.read((char*)&header.reserved2, sizeof(header.reserved2));
-        is.read((char*)&header.offset, sizeof(header.offset));
-        return is;
+    img.channels = 3;
+    img.height = height;
+    img.width = width;
+    img.pixels.resize((size_t)3 * height * width);
+    uint8_t *red = img.channel(0), *green = img.channel(1), *blue = img.channel(2);
+    for (int i = 0; i < height; i++) {
+        const uint8_t* src = data + offset + stride * i;
+        size_t row = (size_t)(top_down ? i : height - 1 - i) * width;
+        if (bit_count == 8) {
+            for (int j = 0; j < width; j++) {
+                const uint8_t* color = palette + 4 * min<uint32_t>(src[j], colors - 1);
+                red[row + j] = color[2], green[row + j] = color[1], blue[row + j] = color[0];
+            }
+        } else {
+            int step = bit_count / 8;
+            for (int j = 0; j < width; j++, src += step) {
+                red[row + j] = src[2], green[row + j] = src[1], blue[row + j] = src[0];
+            }
+        }
     }
-};
+    return true;
+}
 
-struct BitmapInfoHeader {
-    unsigned int size;
-    unsigned int width;
-    unsigned int height;
-    unsigned short planes;
-    unsigned short bitCount;
-    unsigned int compression;
-    unsigned int sizeImage;
-    unsigned int xPelsPerMeter;
-    unsigned int yPelsPerMeter;
-    unsigned int clrUsed;
-    unsigned int clrImportant;
+// maps the file instead of reading it where mmap exists
+bool readBmpBytes(string filename, ByteImage& img)
+{
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    bool ok = decodeBmp((const uint8_t*)data, st.st_size, img);
+    munmap(data, st.st_size);
+    return ok;
+#else
+    ifstream f(filename, ios::binary);
+    if (!f.is_open())
+        return false;
+    vector<uint8_t> data((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+    return decodeBmp(data.data(), data.size(), img);
+#endif
+}
 
-    friend ostream& operator<<(ostream& os, const BitmapInfoHeader& header)
-    {
-        os << header.size;
-        os << header.width;
-        os << header.height;
-        os << header.planes;
-        os << header.bitCount;
-        os << header.compression;
-        os << header.sizeImage;
-        os << header.xPelsPerMeter;
-        os << header.yPelsPerMeter;
-        os << header.clrUsed;
-        os << header.clrImportant;
-        return os;
+// 3 x (height * width), red, green and blue scaled to [0, 1]
+mutil::Mat readBmp(string filename)
+{
+    ByteImage img;
+    if (!readBmpBytes(filename, img)) {
+        std::cout << "Error: can't decode " << filename << std::endl;
+        return mutil::Mat();
     }
+    return img.to_Mat();
+}
 
-    friend istream& operator>>(istream& is, BitmapInfoHeader& header)
-    {
-        is.read((char*)&header.size, sizeof(header.size));
-        is.read((char*)&header.width, sizeof(header.width));
-        is.read((char*)&header.height, sizeof(header.height));
-        is.read((char*)&header.planes, sizeof(header.planes));
-        is.read((char*)&header.bitCount, sizeof(header.bitCount));
-        is.read((char*)&header.compression, sizeof(header.compression));
-        is.read((char*)&header.sizeImage, sizeof(header.sizeImage));
-        is.read((char*)&header.xPelsPerMeter, sizeof(header.xPelsPerMeter));
-        is.read((char*)&header.yPelsPerMeter, sizeof(header.yPelsPerMeter));
-        is.read((char*)&header.clrUsed, sizeof(header.clrUsed));
-        is.read((char*)&header.clrImportant, sizeof(header.clrImportant));
-        return is;
+// bilinear resize of one channel, pixel centres aligned
+void resizeBilinear(const uint8_t* src, int src_height, int src_width, uint8_t* dst, int height, int width)
+{
+    float sy = (float)src_height / height, sx = (float)src_width / width;
+    for (int i = 0; i < height; i++) {
+        float y = max(0.0f, (i + 0.5f) * sy - 0.5f);
+        int y0 = min((int)y, src_height - 1), y1 = min(y0 + 1, src_height - 1);
+        float fy = y - y0;
+        for (int j = 0; j < width; j++) {
+            float x = max(0.0f, (j + 0.5f) * sx - 0.5f);
+            int x0 = min((int)x, src_width - 1), x1 = min(x0 + 1, src_width - 1);
+            float fx = x - x0;
+            float top = src[y0 * src_width + x0] + fx * (src[y0 * src_width + x1] - src[y0 * src_width + x0]);
+            float bottom = src[y1 * src_width + x0] + fx * (src[y1 * src_width + x1] - src[y1 * src_width + x0]);
+            dst[i * width + j] = (uint8_t)(top + fy * (bottom - top) + 0.5f);
+        }
     }
-};
+}
 
-struct Color {
-    unsigned char blue;
-    unsigned char green;
-    unsigned char red;
-    unsigned char reserved;
+// N images of channels x height x width bytes in one contiguous buffer
+struct ImageBatch {
+    int channels = 0, height = 0, width = 0;
+    vector<string> files;
+    vector<string> failed; // files that couldn't be decoded, their slots are black
+    vector<uint8_t> pixels;
 
-    friend ostream& operator<<(ostream& os, const Color& color)
-    {
-        os << color.blue;
-        os << color.green;
-        os << color.red;
-        os << color.reserved;
-        return os;
-    }
+    int size() { return files.size(); }
+    uint8_t* image(int i) { return pixels.data() + (size_t)i * channels * height * width; }
 
-    friend istream& operator>>(istream& is, Color& color)
+    // sample i as the network input, channels x (height * width) in [0, 1]
+    Mat sample(int i)
     {
-        is.read((char*)&color.blue, sizeof(color.blue));
-        is.read((char*)&color.green, sizeof(color.green));
-        is.read((char*)&color.red, sizeof(color.red));
-        is.read((char*)&color.reserved, sizeof(color.reserved));
-        return is;
+        Mat res(channels, height * width);
+        auto dst = res[0];
+        uint8_t* src = image(i);
+        for (int j = 0; j < channels * height * width; j++) {
+            dst[j] = src[j] / 255.0f;
+        }
+        return res;
     }
 };
 
-mutil::Mat readBmp(string filename)
+// decodes every .bmp in dir, sorted by name, on the shared thread pool and resizes it to
+// shape { channels, height, width }. one channel means luminance, three means RGB. a missing
+// or unreadable dir gives an empty batch
+ImageBatch readBmpDirectory(string dir, vector<int> shape)
 {
-    mutil::Mat img;
-    ifstream f(filename, ios::binary);
-    if (!f.is_open()) {
-        std::cout << "Error: File not found" << std::endl;
-        return img;
-    }
-    BitmapFileHeader fileHeader;
-    BitmapInfoHeader infoHeader;
-    f >> fileHeader;
-    f >> infoHeader;
-    if (infoHeader.bitCount > 16) {
-        f.seekg(54, ios::beg);
-        infoHeader.clrUsed = infoHeader.clrImportant = 0;
-    } else if (!infoHeader.clrUsed) {
-        infoHeader.clrUsed = infoHeader.bitCount;
-    }
-    Color color[infoHeader.clrUsed];
-    for (Color& c : color) {
-        f >> c;
+    ImageBatch batch;
+    batch.channels = shape[0], batch.height = shape[1], batch.width = shape[2];
+    error_code error;
+    for (filesystem::directory_iterator it(dir, error), end; !error && it != end; it.increment(error)) {
+        string ext = it->path().extension().string();
+        transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        error_code type_error; // an entry whose type can't be read is skipped
+        if (it->is_regular_file(type_error) && ext == ".bmp")
+            batch.files.push_back(it->path().string());
     }
-    int byteCount = infoHeader.bitCount >> 3;
-    int size = byteCount * infoHeader.width * infoHeader.size;
-    char data[size];
-    f.read(data, sizeof(data));
-    f.close();
-    img = mutil::Mat(3, infoHeader.width * infoHeader.size);
-    for (int i = 0; i < infoHeader.height; i++) {
-        int row = infoHeader.height - 1 - i;
-        for (int j = 0; j < infoHeader.width; j++) {
-            int col = j;
-            if (infoHeader.bitCount > 16) {
-                img[0][row * infoHeader.width + col] = data[byteCount * (i * infoHeader.width + j) + 2] / 255.0;
-                img[1][row * infoHeader.width + col] = data[byteCount * (i * infoHeader.width + j) + 1] / 255.0;
-                img[2][row * infoHeader.width + col] = data[byteCount * (i * infoHeader.width + j)] / 255.0;
+    sort(batch.files.begin(), batch.files.end());
+    int area = batch.height * batch.width;
+    batch.pixels.assign((size_t)batch.size() * batch.channels * area, 0);
+    vector<char> ok(batch.size());
+    pool::parallel_for(0, batch.size(), 1, [&](long lo, long hi) {
+        ByteImage img;
+        vector<uint8_t> gray;
+        for (int i = lo; i < hi; i++) {
+            if (!(ok[i] = readBmpBytes(batch.files[i], img)))
+                continue;
+            uint8_t* dst = batch.image(i);
+            if (batch.channels == 1) {
+                gray.resize((size_t)img.height * img.width);
+                for (size_t p = 0; p < gray.size(); p++) {
+                    gray[p] = (uint8_t)(0.299f * img.channel(0)[p] + 0.587f * img.channel(1)[p] + 0.114f * img.channel(2)[p] + 0.5f);
+                }
+                resizeBilinear(gray.data(), img.height, img.width, dst, batch.height, batch.width);
             } else {
-                int index = data[byteCount * (i * infoHeader.width + j)];
-                img[0][row * infoHeader.width + col] = color[index].red / 255.0;
-                img[1][row * infoHeader.width + col] = color[index].green / 255.0;
-                img[2][row * infoHeader.width + col] = color[index].blue / 255.0;
+                for (int c = 0; c < batch.channels; c++) {
+                    resizeBilinear(img.channel(min(c, 2)), img.height, img.width, dst + c * area, batch.height, batch.width);
+                }
             }
         }
+    });
+    for (int i = 0; i < batch.size(); i++) {
+        if (!ok[i])
+            batch.failed.push_back(batch.files[i]);
     }
-    return img;
+    return batch;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,168 @@
+#ifndef CHECKPOINT_CPP
+#define CHECKPOINT_CPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#ifndef NOMINMAX
+#define NOMINMAX // windows.h would define min and max as macros
+#endif
+#include <windows.h>
+#endif
+
+using namespace std;
+
+// a snapshot owns copies of the parameters and writes them in checkpoint format
+typedef vector<function<void(ofstream&)>> Snapshot;
+
+// writes checkpoints on a background thread. save() only takes the snapshot, the
+// text formatting, fsync and the atomic rename over path happen off the training
+// thread. if a write is still running the newest snapshot waits and older ones are dropped.
+// a write that fails anywhere leaves the previous checkpoint in place and counts in failed()
+class CheckpointWriter {
+    string path;
+    thread worker;
+    mutex lock;
+    condition_variable cv;
+    Snapshot pending;
+    bool has_pending = false, writing = false, stop = false;
+    int batches = 0;
+    int writes = 0, failures = 0;
+    chrono::steady_clock::time_point last;
+
+public:
+    int every_batches;
+    double every_seconds;
+
+    CheckpointWriter(string path, int every_batches = 0, double every_seconds = 0)
+        : path(path)
+        , last(chrono::steady_clock::now())
+        , every_batches(every_batches)
+        , every_seconds(every_seconds)
+    {
+        worker = thread([this] { run(); });
+    }
+
+    ~CheckpointWriter()
+    {
+        flush();
+        {
+            lock_guard<mutex> guard(lock);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    // called once per batch, true when a periodic checkpoint is due
+    bool due()
+    {
+        batches++;
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - last).count();
+        return (every_batches && batches % every_batches == 0) || (every_seconds > 0 && elapsed >= every_seconds);
+    }
+
+    void save(Snapshot snapshot)
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            pending = move(snapshot);
+            has_pending = true;
+            last = chrono::steady_clock::now();
+        }
+        cv.notify_all();
+    }
+
+    // blocks until every requested checkpoint is on disk
+    void flush()
+    {
+        unique_lock<mutex> guard(lock);
+        cv.wait(guard, [this] { return !has_pending && !writing; });
+    }
+
+    // checkpoints that reached disk and that failed so far, flush() first to count all requested
+    int written()
+    {
+        lock_guard<mutex> guard(lock);
+        return writes;
+    }
+
+    int failed()
+    {
+        lock_guard<mutex> guard(lock);
+        return failures;
+    }
+
+private:
+    void run()
+    {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            cv.wait(guard, [this] { return has_pending || stop; });
+            if (!has_pending)
+                return;
+            Snapshot snapshot = move(pending);
+            has_pending = false;
+            writing = true;
+            guard.unlock();
+            bool ok = write(snapshot);
+            guard.lock();
+            writing = false;
+            (ok ? writes : failures)++;
+            cv.notify_all();
+        }
+    }
+
+    bool write(Snapshot& snapshot)
+    {
+        string tmp = path + ".tmp";
+        {
+            ofstream out(tmp, ios::out | ios::trunc | ios::binary);
+            for (auto& layer : snapshot) {
+                layer(out);
+            }
+            out.close();
+            if (!out) {
+                remove(tmp.c_str());
+                return false;
+            }
+        }
+#ifndef _WIN32
+        int fd = open(tmp.c_str(), O_RDONLY);
+        bool synced = fd >= 0 && fsync(fd) == 0;
+        if (fd >= 0)
+            close(fd);
+        if (!synced || rename(tmp.c_str(), path.c_str()) != 0) {
+            remove(tmp.c_str());
+            return false;
+        }
+        // the rename is only durable once the directory entry is
+        size_t slash = path.find_last_of('/');
+        string dir = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        synced = fd >= 0 && fsync(fd) == 0;
+        if (fd >= 0)
+            close(fd);
+        return synced;
+#else
+        // replaces path in one step, there is no moment without a checkpoint
+        if (!MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+            remove(tmp.c_str());
+            return false;
+        }
+        return true;
+#endif
+    }
+};
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef DATASET_CPP
+#define DATASET_CPP
+
+#include "mutil.cpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace mutil;
+
+// preprocessed dataset cache, split into shards prefix.0.nnds, prefix.1.nnds, ... each laid out as
+// header | uint64 offset of every sample | uint8 label of every sample | packed uint8 samples.
+// the stats describe the whole dataset so every shard can normalize on its own
+struct DatasetHeader {
+    uint32_t magic = 0x53444e4e; // "NNDS"
+    uint32_t version = 1;
+    uint32_t count = 0; // samples in this shard
+    uint32_t first = 0; // global index of the first one
+    uint32_t channels = 0, height = 0, width = 0;
+    uint32_t classes = 0;
+    float mean = 0, stddev = 1; // of all pixels scaled to [0, 1]
+    uint64_t index_offset = 0, label_offset = 0, data_offset = 0;
+};
+
+static string shardName(string prefix, int shard)
+{
+    return prefix + "." + to_string(shard) + ".nnds";
+}
+
+// writes images and labels as shards of at most shard_size samples, each through a
+// temporary file renamed into place. false if a shard can't be written
+bool writeDatasetCache(string prefix, vector<ByteImage>& images, vector<int>& labels, int classes, int shard_size = 65536)
+{
+    if (images.empty() || images.size() != labels.size())
+        return false;
+    double sum = 0, square = 0, n = 0;
+    for (auto& img : images) {
+        for (uint8_t p : img.pixels) {
+            sum += p / 255.0;
+            square += p / 255.0 * p / 255.0;
+        }
+        n += img.pixels.size();
+    }
+    DatasetHeader header;
+    header.channels = images[0].channels, header.height = images[0].height, header.width = images[0].width;
+    header.classes = classes;
+    header.mean = sum / n;
+    header.stddev = sqrt(max(0.0, square / n - header.mean * header.mean));
+    for (int first = 0, shard = 0; first < images.size(); first += shard_size, shard++) {
+        header.first = first;
+        header.count = min<int>(shard_size, images.size() - first);
+        header.index_offset = sizeof(DatasetHeader);
+        header.label_offset = header.index_offset + 8 * header.count;
+        header.data_offset = header.label_offset + header.count;
+        vector<uint64_t> offsets(header.count);
+        vector<uint8_t> compact(header.count);
+        uint64_t offset = header.data_offset;
+        for (int i = 0; i < header.count; i++) {
+            offsets[i] = offset;
+            offset += images[first + i].pixels.size();
+            compact[i] = labels[first + i];
+        }
+        string name = shardName(prefix, shard);
+        {
+            ofstream out(name + ".tmp", ios::binary | ios::trunc);
+            out.write((char*)&header, sizeof(header));
+            out.write((char*)offsets.data(), 8 * offsets.size());
+            out.write((char*)compact.data(), compact.size());
+            for (int i = 0; i < header.count; i++) {
+                out.write((char*)images[first + i].pixels.data(), images[first + i].pixels.size());
+            }
+            if (!out)
+                return false;
+        }
+        remove(name.c_str());
+        if (rename((name + ".tmp").c_str(), name.c_str()) != 0)
+            return false;
+    }
+    // a shorter rewrite must not leave stale shards behind
+    for (int shard = (images.size() + shard_size - 1) / shard_size; remove(shardName(prefix, shard).c_str()) == 0; shard++) {
+    }
+    return true;
+}
+
+// read-only view of one mapped shard file
+class Shard {
+    const uint8_t* data = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    vector<uint8_t> buffer;
+#endif
+
+public:
+    DatasetHeader header;
+
+    bool open(string name)
+    {
+#ifndef _WIN32
+        int fd = ::open(name.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < sizeof(DatasetHeader)) {
+            close(fd);
+            return false;
+        }
+        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            return false;
+        data = (const uint8_t*)map;
+        length = st.st_size;
+#else
+        ifstream in(name, ios::binary);
+        if (!in.is_open())
+            return false;
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        data = buffer.data();
+        length = buffer.size();
+        if (length < sizeof(DatasetHeader))
+            return false;
+#endif
+        memcpy(&header, data, sizeof(header));
+        return header.magic == DatasetHeader().magic && header.version == DatasetHeader().version && valid();
+    }
+
+    // every table and sample lies inside the file, compared by subtraction so a corrupt
+    // offset can't wrap around. sample() and label() trust this afterwards
+    bool valid()
+    {
+        uint64_t count = header.count, size = (uint64_t)header.channels * header.height * header.width;
+        if (header.index_offset > length || 8 * count > length - header.index_offset)
+            return false;
+        if (header.label_offset > length || count > length - header.label_offset)
+            return false;
+        if (header.data_offset > length || size > length)
+            return false;
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t offset;
+            memcpy(&offset, data + header.index_offset + 8 * i, 8);
+            if (offset < header.data_offset || offset > length - size)
+                return false;
+            if (data[header.label_offset + i] >= header.classes)
+                return false;
+        }
+        return true;
+    }
+
+    ~Shard()
+    {
+#ifndef _WIN32
+        if (data)
+            munmap((void*)data, length);
+#endif
+    }
+
+    const uint8_t* sample(int i)
+    {
+        uint64_t offset;
+        memcpy(&offset, data + header.index_offset + 8 * i, 8);
+        return data + offset;
+    }
+
+    int label(int i) { return data[header.label_offset + i]; }
+};
+
+// random access to a cache written by writeDatasetCache. samples stay in the page cache,
+// nothing is decoded until it is asked for, so shuffling is a permutation of indices. train
+// with network.train(cache.size(), [&](int i) { return cache[i]; }), which keeps the
+// permutation in the network's resumable state
+class DatasetCache {
+    vector<unique_ptr<Shard>> shards;
+    vector<int> firsts;
+
+public:
+    int channels = 0, height = 0, width = 0, classes = 0;
+    float mean = 0, stddev = 1;
+    bool normalize = false; // (x - mean) / stddev instead of x, with x in [0, 1]
+
+    // opens prefix.0.nnds, prefix.1.nnds, ... until one is missing
+    DatasetCache(string prefix)
+    {
+        for (int shard = 0;; shard++) {
+            unique_ptr<Shard> s(new Shard());
+            if (!s->open(shardName(prefix, shard)))
+                break;
+            firsts.push_back(s->header.first);
+            shards.push_back(move(s));
+        }
+        if (!shards.empty()) {
+            DatasetHeader& header = shards[0]->header;
+            channels = header.channels, height = header.height, width = header.width;
+            classes = header.classes, mean = header.mean, stddev = header.stddev;
+        }
+    }
+
+    int size() { return shards.empty() ? 0 : shards.back()->header.first + shards.back()->header.count; }
+
+    const uint8_t* pixels(int i)
+    {
+        int shard = upper_bound(firsts.begin(), firsts.end(), i) - firsts.begin() - 1;
+        return shards[shard]->sample(i - firsts[shard]);
+    }
+
+    int label(int i)
+    {
+        int shard = upper_bound(firsts.begin(), firsts.end(), i) - firsts.begin() - 1;
+        return shards[shard]->label(i - firsts[shard]);
+    }
+
+    ByteImage image(int i)
+    {
+        ByteImage img;
+        img.channels = channels, img.height = height, img.width = width;
+        img.pixels.assign(pixels(i), pixels(i) + channels * height * width);
+        return img;
+    }
+
+    // sample i as a network input and one-hot label
+    pair<Mat, Mat> operator[](int i)
+    {
+        Mat in(channels, height * width), ans(1, classes);
+        const uint8_t* src = pixels(i);
+        auto dst = in[0];
+        for (int j = 0; j < channels * height * width; j++) {
+            dst[j] = normalize ? (src[j] / 255.0f - mean) / stddev : src[j] / 255.0f;
+        }
+        ans[0][label(i)] = 1;
+        return { in, ans };
+    }
+};
+
+#endif
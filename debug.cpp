@@ -2,7 +2,11 @@
 #define DEBUG_CPP
 
 #include "mutil.cpp"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <random>
+#include <vector>
 
 namespace debug {
 
@@ -16,6 +20,64 @@ void print(mutil::Kernel& k)
     }
 }
 
+// finite-difference check of a layer's backward pass. the loss is sum(forward(in) .* r) for a
+// fixed random r, so backward(r) must return dloss/din and accumulate dloss/dparameter into
+// gradients(). every input and parameter entry is nudged by +-eps and the worst relative error
+// against the analytic gradient is returned, a few 1e-3 is float round-off. a template since
+// Layer is defined after this file
+template <typename L>
+float gradcheck(L& layer, mutil::Mat in, float eps = 1e-2f, unsigned seed = 1)
+{
+    std::default_random_engine e(seed);
+    std::uniform_real_distribution<float> uniform(-1, 1);
+    auto forward = [&]() {
+        mutil::Mat copy = in; // layers may work in place on their input
+        return mutil::Mat(layer.forward(copy));
+    };
+    mutil::Mat out = forward(), r(out.size.first, out.size.second);
+    for (int i = 0; i < r.size.first; i++) {
+        for (int j = 0; j < r.size.second; j++) {
+            r[i][j] = uniform(e);
+        }
+    }
+    auto loss = [&]() {
+        mutil::Mat y = forward();
+        double sum = 0;
+        for (int i = 0; i < y.size.first; i++) {
+            for (int j = 0; j < y.size.second; j++) {
+                sum += (double)y[i][j] * r[i][j];
+            }
+        }
+        return sum;
+    };
+    for (auto grad : layer.gradients()) {
+        grad->clear();
+    }
+    forward();
+    mutil::Mat delta_in = layer.backward(r);
+    float worst = 0;
+    auto check = [&](mutil::Mat& value, mutil::Mat& analytic) {
+        for (int i = 0; i < value.size.first; i++) {
+            for (int j = 0; j < value.size.second; j++) {
+                float saved = value[i][j];
+                value[i][j] = saved + eps;
+                double plus = loss();
+                value[i][j] = saved - eps;
+                double minus = loss();
+                value[i][j] = saved;
+                double numeric = (plus - minus) / (2 * eps), exact = analytic[i][j];
+                worst = std::max(worst, (float)(std::fabs(numeric - exact) / std::max(1e-2, std::fabs(numeric) + std::fabs(exact))));
+            }
+        }
+    };
+    check(in, delta_in);
+    std::vector<mutil::Mat*> parameters = layer.parameters(), gradients = layer.gradients();
+    for (int k = 0; k < parameters.size(); k++) {
+        check(*parameters[k], *gradients[k]);
+    }
+    return worst;
+}
+
 }
 
 #endif
\ No newline at end of file
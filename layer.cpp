@@ -1,13 +1,42 @@
 #ifndef LAYER_CPP
 #define LAYER_CPP
 
+#include "autograd.cpp"
 #include "debug.cpp"
 #include "mutil.cpp"
 #include "optimizer.cpp"
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <iomanip>
+#include <string>
 
 using namespace mutil;
 
+// constexpr array definition for inference bundles, printed with enough digits to round-trip
+static void emitArray(ostream& out, string name, Mat& mat)
+{
+    out << "alignas(64) static constexpr float " << name << "[" << mat.size.first * mat.size.second << "] = {";
+    for (int i = 0; i < mat.size.first; i++) {
+        for (int j = 0; j < mat.size.second; j++) {
+            out << ((i || j) ? ", " : " ") << setprecision(9) << mat[i][j] << "f";
+        }
+    }
+    out << " };\n";
+}
+
+// indices of the values of the kept channels in a channel-major array with area values per channel
+static vector<int> expandChannels(const vector<int>& keep, int area)
+{
+    vector<int> res;
+    for (int c : keep) {
+        for (int p = 0; p < area; p++) {
+            res.push_back(c * area + p);
+        }
+    }
+    return res;
+}
+
 static init::Initializer* getInit(init::Type type, int n)
 {
     if (type == init::KAIMING)
@@ -22,14 +51,87 @@ static init::Initializer* getInit(init::Type type, int n)
 }
 
 class Layer {
+protected:
+    Layout layout = NCHW;
+    deque<Mat> local_scratch;
+    deque<Mat>* scratch = &local_scratch; // a deque keeps references valid as slots are added
+
+    // scratch buffer of the given slot, shared between layers once Network has planned memory
+    Mat& buffer(int slot, int m, int n)
+    {
+        if (scratch->size() <= slot)
+            scratch->resize(slot + 1);
+        return (*scratch)[slot].reshape(m, n);
+    }
 
 public:
+    virtual ~Layer() { }
+    // shapes are { channel, height, width }, a layer's output Mat is channel x (height * width)
+    virtual vector<int> build(vector<int> shape) { return shape; }
+    // floats needed in each scratch slot while the layer runs
+    virtual vector<int> scratchSizes() { return {}; }
+    void bindScratch(deque<Mat>* scratch) { this->scratch = scratch; }
+    // layouts forward accepts, preferred first. empty means any, the layer keeps its input's
+    virtual vector<Layout> layouts() { return { NCHW }; }
+    virtual void setLayout(Layout layout) { this->layout = layout; }
+    Layout dataLayout() { return layout; }
+
     virtual Mat& forward(Mat& in) = 0;
     virtual Mat backward(Mat& in) = 0;
     virtual void randomize(default_random_engine& e) = 0;
     virtual void learn(Optimizer* optimizer) = 0;
     virtual void saveCheckpoint(ofstream& ofstream) = 0;
     virtual void loadCheckpoint(ifstream& ifstream) = 0;
+    // magnitude-prunes the weights to the given fraction of zeros, no-op for layers without weights
+    virtual void prune(float sparsity) { }
+    // structured pruning: how a layer treats the channels of its input, see keepInputs
+    enum ChannelUse {
+        PASSES, // output channels are the input channels
+        CONSUMES, // mixes them into its own outputs
+        BLOCKS // can't lose any
+    };
+    virtual ChannelUse channelUse() { return BLOCKS; }
+    // drops every input channel not in keep, sorted. area is the values per channel, which a
+    // flat input stores consecutively
+    virtual void keepInputs(const vector<int>& keep, int area) { }
+    // multiply-adds of one forward pass
+    virtual long multiplyAdds() { return 0; }
+    // floats cached by forward for backward, release() frees them until the next forward
+    virtual long cacheSize() { return 0; }
+    virtual void release() { }
+    // stateful layers depend on previous calls and can't be recomputed
+    virtual bool stateful() { return false; }
+    // trainable Mats and their accumulated gradients, in the same order
+    virtual vector<Mat*> parameters() { return {}; }
+    virtual vector<Mat*> gradients() { return {}; }
+    // binary training state: parameters and the gradients accumulated so far
+    virtual void saveState(ostream& out)
+    {
+        for (auto mat : parameters()) {
+            mat->write(out);
+        }
+        for (auto mat : gradients()) {
+            mat->write(out);
+        }
+    }
+    virtual void loadState(istream& in)
+    {
+        for (auto mat : parameters()) {
+            mat->read(in);
+        }
+        for (auto mat : gradients()) {
+            mat->read(in);
+        }
+    }
+    // inference bundle code: weights as arrays named prefix_*, and a block computing the
+    // float buffer dst from src for the given input shape. false if the layer can't be exported
+    virtual void emitWeights(ostream& out, string prefix) { }
+    virtual bool emitForward(ostream& out, string prefix, vector<int> shape) { return false; }
+    // copies the checkpointed state now, the returned writer may run on another thread
+    virtual function<void(ofstream&)> snapshot()
+    {
+        return [](ofstream& ofstream) {};
+    }
 };
 
 class FlattenLayer : public Layer {
@@ -40,6 +142,18 @@ public:
     FlattenLayer()
     {
     }
+    vector<int> build(vector<int> shape)
+    {
+        return { 1, 1, shape[0] * shape[1] * shape[2] };
+    }
+    ChannelUse channelUse() { return PASSES; }
+
+    bool emitForward(ostream& out, string prefix, vector<int> shape)
+    {
+        out << "    for (int i = 0; i < " << shape[0] * shape[1] * shape[2] << "; i++)\n";
+        out << "        dst[i] = src[i];\n";
+        return true;
+    }
     Mat& forward(Mat& in)
     {
         in_size = in.size;
@@ -74,9 +188,59 @@ public:
     }
 };
 
+// converts activations between layouts, inserted by Network::build where neighbours disagree
+class LayoutLayer : public Layer {
+    vector<int> in_size;
+    Layout from, to;
+    Mat y;
+
+public:
+    LayoutLayer(Layout from, Layout to)
+        : from(from)
+        , to(to)
+    {
+        layout = to;
+    }
+    vector<int> build(vector<int> shape)
+    {
+        in_size = shape;
+        return shape;
+    }
+    vector<Layout> layouts() { return { to }; }
+    void setLayout(Layout layout) { }
+    ChannelUse channelUse() { return PASSES; }
+
+    bool emitForward(ostream& out, string prefix, vector<int> shape)
+    {
+        int channels = shape[0], area = shape[1] * shape[2];
+        out << "    for (int c = 0; c < " << channels << "; c++)\n";
+        out << "        for (int p = 0; p < " << area << "; p++)\n";
+        if (to == NHWC)
+            out << "            dst[p * " << channels << " + c] = src[c * " << area << " + p];\n";
+        else
+            out << "            dst[c * " << area << " + p] = src[p * " << channels << " + c];\n";
+        return true;
+    }
+    Mat& forward(Mat& in)
+    {
+        mutil::transform_layout(in, in_size[0], in_size[1] * in_size[2], from, to, y);
+        return y;
+    }
+    Mat backward(Mat& in)
+    {
+        Mat ret;
+        mutil::transform_layout(in, in_size[0], in_size[1] * in_size[2], to, from, ret);
+        return ret;
+    }
+    void randomize(default_random_engine& e) {};
+    void learn(Optimizer* optimizer) {};
+    void saveCheckpoint(ofstream& ofstream) {};
+    void loadCheckpoint(ifstream& ifstream) {};
+};
+
 class ActivationLayer : public Layer {
 protected:
-    Mat x;
+    Mat y; // output, for layers whose derivative is a function of it
 
 public:
     ActivationLayer()
@@ -88,6 +252,20 @@ public:
     void learn(Optimizer* optimizer) {};
     void saveCheckpoint(ofstream& ofstream) {};
     void loadCheckpoint(ifstream& ifstream) {};
+    long cacheSize() { return (long)y.size.first * y.size.second; }
+    void release() { y = Mat(); }
+    vector<Layout> layouts() { return {}; }
+    ChannelUse channelUse() { return PASSES; }
+
+    // the activation applied to the C++ expression v
+    virtual string expression(string v) = 0;
+
+    bool emitForward(ostream& out, string prefix, vector<int> shape)
+    {
+        out << "    for (int i = 0; i < " << shape[0] * shape[1] * shape[2] << "; i++)\n";
+        out << "        dst[i] = " << expression("src[i]") << ";\n";
+        return true;
+    }
 };
 
 class SigmoidLayer : public ActivationLayer {
@@ -97,32 +275,42 @@ public:
     }
     Mat& forward(Mat& in)
     {
-        x = in;
         mutil::sigmoid(in);
+        y = in;
         return in;
     }
+    // s' = s (1 - s)
     Mat backward(Mat& in)
     {
-        mutil::sigmoid_prime(x);
-        return in.dot(x);
+        return mutil::combine(in, y, [](float d, float s) { return d * s * (1 - s); });
+    }
+    string expression(string v)
+    {
+        return "1 / (1 + std::exp(-" + v + "))";
     }
 };
 
 class RELULayer : public ActivationLayer {
+    mutil::Mask mask;
+
 public:
     RELULayer()
     {
     }
     Mat& forward(Mat& in)
     {
-        x = in;
-        mutil::relu(in);
-        return in;
+        return mutil::relu(in, mask);
     }
     Mat backward(Mat& in)
     {
-        mutil::relu_prime(x);
-        return in.dot(x);
+        return mutil::relu_prime(in, mask);
+    }
+    // in floats, rounded up
+    long cacheSize() { return mask.size() * 2; }
+    void release() { mask = mutil::Mask(); }
+    string expression(string v)
+    {
+        return "std::max(0.0f, " + v + ")";
     }
 };
 
@@ -133,14 +321,18 @@ public:
     }
     Mat& forward(Mat& in)
     {
-        x = in;
         mutil::tanh(in);
+        y = in;
         return in;
     }
+    // t' = 1 - t^2
     Mat backward(Mat& in)
     {
-        mutil::tanh_prime(x);
-        return in.dot(x);
+        return mutil::combine(in, y, [](float d, float t) { return d * (1 - t * t); });
+    }
+    string expression(string v)
+    {
+        return "std::tanh(" + v + ")";
     }
 };
 
@@ -163,16 +355,22 @@ public:
     virtual void learn(Optimizer* optimizer) = 0;
     virtual void saveCheckpoint(ofstream& ofstream) = 0;
     virtual void loadCheckpoint(ifstream& ifstream) = 0;
+    long cacheSize() { return (long)x.size.first * x.size.second; }
+    void release() { x = Mat(); }
 };
 
 class DenseLayer : public LinearLayer {
 protected:
     Mat w, b;
     init::Initializer* u;
+    init::Type type = init::KAIMING;
+    bool pruned = false;
 
 public:
     Mat delta_w, delta_b;
     Mat nabla_w, nabla_b;
+    SparseMat sparse_w; // replaces w once pruned
+    Mat delta_sw, nabla_sw;
     DenseLayer(int in, int out, init::Initializer* u)
         : LinearLayer(in, out)
         , w(in, out)
@@ -191,6 +389,25 @@ public:
     {
     }
 
+    // in is inferred by Network::build
+    DenseLayer(int out, init::Type type = init::KAIMING)
+        : DenseLayer(0, out, (init::Initializer*)nullptr)
+    {
+        this->type = type;
+    }
+
+    vector<int> build(vector<int> shape)
+    {
+        in = shape[0] * shape[1] * shape[2];
+        if (!u)
+            u = getInit(type, in + out);
+        if (w.size.first != in) {
+            x = Mat(1, in);
+            w = Mat(in, out), delta_w = Mat(in, out), nabla_w = Mat(in, out);
+        }
+        return { 1, 1, out };
+    }
+
     ~DenseLayer()
     {
         delete u;
@@ -198,16 +415,34 @@ public:
 
     Mat& forward(Mat& in)
     {
-        y = in * w + b;
+        if (pruned) {
+            y = b;
+            Kernel a(1, this->in, in[0]);
+            Kernel res(1, out, y[0]);
+            mutil::sparse_multiply(a, sparse_w, res);
+        } else {
+            y = in * w + b;
+        }
         x = in;
         return y;
     }
     Mat backward(Mat& in)
     {
-        delta_w = x.transpose() * in;
         delta_b = in;
-        nabla_w += delta_w;
         nabla_b += delta_b;
+        if (pruned) {
+            Kernel a(1, this->in, x[0]);
+            Kernel delta(1, out, in[0]);
+            delta_sw.clear();
+            mutil::sparse_outer(a, delta, sparse_w, delta_sw);
+            nabla_sw += delta_sw;
+            Mat ret(1, this->in);
+            Kernel res(1, this->in, ret[0]);
+            mutil::sparse_multiply_transpose(delta, sparse_w, res);
+            return ret;
+        }
+        delta_w = x.transpose() * in;
+        nabla_w += delta_w;
         return in * w.transpose();
     }
 
@@ -218,20 +453,172 @@ public:
 
     void learn(Optimizer* optimizer)
     {
-        w = optimizer->optimize(w, nabla_w);
+        if (pruned) {
+            sparse_w.val = optimizer->optimize(sparse_w.val, nabla_sw);
+            nabla_sw.clear();
+        } else {
+            w = optimizer->optimize(w, nabla_w);
+            nabla_w.clear();
+        }
         b = optimizer->optimize(b, nabla_b);
-        nabla_w.clear();
         nabla_b.clear();
     }
 
+    vector<Mat*> parameters()
+    {
+        if (pruned)
+            return { &sparse_w.val, &b };
+        return { &w, &b };
+    }
+
+    vector<Mat*> gradients()
+    {
+        if (pruned)
+            return { &nabla_sw, &nabla_b };
+        return { &nabla_w, &nabla_b };
+    }
+
+    void saveState(ostream& out)
+    {
+        out.put(pruned);
+        if (pruned)
+            sparse_w.writePattern(out);
+        Layer::saveState(out);
+    }
+
+    void loadState(istream& in)
+    {
+        if (in.get()) {
+            sparse_w.readPattern(in);
+            delta_sw = Mat(1, sparse_w.nnz());
+            w = delta_w = nabla_w = Mat();
+            pruned = true;
+        } else {
+            densify();
+        }
+        Layer::loadState(in);
+    }
+
+    // called with a growing sparsity between epochs this prunes gradually,
+    // entries pruned earlier stay zero and count towards the target
+    void prune(float sparsity)
+    {
+        densify();
+        sparsify(mutil::magnitude_threshold(w, sparsity));
+    }
+
+    // replaces w by its entries above threshold
+    void sparsify(float threshold)
+    {
+        sparse_w = SparseMat(w, threshold);
+        delta_sw = Mat(1, sparse_w.nnz());
+        nabla_sw = Mat(1, sparse_w.nnz());
+        w = delta_w = nabla_w = Mat();
+        pruned = true;
+    }
+
+    ChannelUse channelUse() { return CONSUMES; }
+
+    // an unstructured-pruned layer stays pruned, its zeros stay zero
+    void keepInputs(const vector<int>& keep, int area)
+    {
+        bool sparse = pruned;
+        densify();
+        vector<int> rows = expandChannels(keep, area);
+        Mat kept(rows.size(), out);
+        for (int r = 0; r < rows.size(); r++) {
+            copy(w[rows[r]], w[rows[r]] + out, kept[r]);
+        }
+        in = rows.size();
+        w = kept;
+        x = Mat(1, in), delta_w = Mat(in, out), nabla_w = Mat(in, out);
+        if (sparse)
+            sparsify(0);
+    }
+
+    long multiplyAdds() { return pruned ? sparse_w.nnz() : (long)in * out; }
+
+    void densify()
+    {
+        if (!pruned)
+            return;
+        w = sparse_w.to_Mat();
+        delta_w = Mat(in, out);
+        nabla_w = Mat(in, out);
+        sparse_w = SparseMat();
+        delta_sw = nabla_sw = Mat();
+        pruned = false;
+    }
+
+    // output j becomes output j * scale[j] + shift[j], for folding a following normalization
+    void scaleOutputs(Mat& scale, Mat& shift)
+    {
+        if (pruned) {
+            for (int k = 0; k < sparse_w.nnz(); k++) {
+                sparse_w.val[0][k] *= scale[0][sparse_w.col[k]];
+            }
+        } else {
+            for (int i = 0; i < in; i++) {
+                for (int j = 0; j < out; j++) {
+                    w[i][j] *= scale[0][j];
+                }
+            }
+        }
+        for (int j = 0; j < out; j++) {
+            b[0][j] = b[0][j] * scale[0][j] + shift[0][j];
+        }
+    }
+
     void saveCheckpoint(ofstream& ofstream)
     {
-        ofstream << w << b;
+        if (pruned)
+            ofstream << sparse_w << b;
+        else
+            ofstream << w << b;
+    }
+
+    void emitWeights(ostream& out, string prefix)
+    {
+        Mat weight = pruned ? sparse_w.to_Mat() : w;
+        emitArray(out, prefix + "_w", weight);
+        emitArray(out, prefix + "_b", b);
+    }
+
+    bool emitForward(ostream& out, string prefix, vector<int> shape)
+    {
+        out << "    for (int j = 0; j < " << this->out << "; j++)\n";
+        out << "        dst[j] = " << prefix << "_b[j];\n";
+        out << "    for (int i = 0; i < " << in << "; i++)\n";
+        out << "        for (int j = 0; j < " << this->out << "; j++)\n";
+        out << "            dst[j] += src[i] * " << prefix << "_w[i * " << this->out << " + j];\n";
+        return true;
+    }
+
+    function<void(ofstream&)> snapshot()
+    {
+        Mat bias = b;
+        if (pruned) {
+            SparseMat weight = sparse_w;
+            return [weight, bias](ofstream& ofstream) { ofstream << weight << bias; };
+        }
+        Mat weight = w;
+        return [weight, bias](ofstream& ofstream) { ofstream << weight << bias; };
     }
 
     void loadCheckpoint(ifstream& ifstream)
     {
-        ifstream >> w >> b;
+        ifstream >> ws;
+        if (ifstream.peek() == 'c') {
+            ifstream >> sparse_w;
+            delta_sw = Mat(1, sparse_w.nnz());
+            nabla_sw = Mat(1, sparse_w.nnz());
+            w = delta_w = nabla_w = Mat();
+            pruned = true;
+        } else {
+            densify();
+            ifstream >> w;
+        }
+        ifstream >> b;
     }
 };
 
@@ -239,6 +626,8 @@ class ConvLayer : public Layer {
 protected:
     Mat x, y;
     init::Initializer* u;
+    init::Type type = init::KAIMING;
+    bool fan_forward = true;
     vector<int> in_size, kernel_size;
     pair<int, int> out_size;
 
@@ -247,43 +636,111 @@ public:
     Mat w, b;
     Mat delta_w, delta_b;
     Mat nabla_w, nabla_b;
+    bool pruned = false;
+    SparseMat sparse_w; // replaces w once pruned
+    Mat delta_sw, nabla_sw;
+    bool implicit_gemm = true; // builds im2col tiles inside the GEMM instead of the whole column buffer
 
 public:
     ConvLayer(int height, int width, int channel, int kernel_height, int kernel_width, int kernel_count, int stride, int padding, init::Initializer* u)
-        : w(channel * kernel_count, kernel_height * kernel_width)
-        , b(kernel_count, 1)
-        , delta_w(channel * kernel_count, kernel_height * kernel_width)
-        , delta_b(kernel_count, 1)
-        , nabla_w(channel * kernel_count, kernel_height * kernel_width)
-        , nabla_b(kernel_count, 1)
-        , u(u)
+        : ConvLayer(kernel_height, kernel_width, kernel_count, stride, padding)
+    {
+        this->u = u;
+        build({ channel, height, width });
+    }
+
+    ConvLayer(int height, int width, int channel, int kernel_height, int kernel_width, int kernel_count, int stride, int padding, init::Type type = init::KAIMING, bool forward = true)
+        : ConvLayer(height, width, channel, kernel_height, kernel_width, kernel_count, stride, padding, getInit(type, forward ? channel * kernel_height * kernel_width : kernel_count * kernel_height * kernel_width))
+    {
+    }
+
+    // input shape is inferred by Network::build
+    ConvLayer(int kernel_height, int kernel_width, int kernel_count, int stride, int padding, init::Type type = init::KAIMING, bool forward = true)
+        : u(nullptr)
+        , type(type)
+        , fan_forward(forward)
     {
-        this->in_size = { channel, height, width };
         this->kernel_size = { kernel_count, kernel_height, kernel_width };
         this->stride = stride;
         this->padding = padding;
-        nabla_w.clear(), nabla_b.clear();
+    }
+
+    vector<int> build(vector<int> shape)
+    {
+        int kernel_area = kernel_size[1] * kernel_size[2];
+        if (!u)
+            u = getInit(type, fan_forward ? shape[0] * kernel_area : kernel_size[0] * kernel_area);
+        if (in_size != shape) {
+            in_size = shape;
+            w = Mat(in_size[0] * kernel_size[0], kernel_area);
+            b = Mat(kernel_size[0], 1);
+            delta_w = Mat(in_size[0] * kernel_size[0], kernel_area);
+            delta_b = Mat(kernel_size[0], 1);
+            nabla_w = Mat(in_size[0] * kernel_size[0], kernel_area);
+            nabla_b = Mat(kernel_size[0], 1);
+        }
         out_size = mutil::compute_output_size(in_size[1], in_size[2], kernel_size[1], kernel_size[2], stride, padding);
-        y = Mat(kernel_size[0], out_size.first * out_size.second);
+        setLayout(layout);
+        return { kernel_size[0], out_size.first, out_size.second };
     }
 
-    ConvLayer(int height, int width, int channel, int kernel_height, int kernel_width, int kernel_count, int stride, int padding, init::Type type = init::KAIMING, bool forward = true)
-        : ConvLayer(height, width, channel, kernel_height, kernel_width, kernel_count, stride, padding, getInit(type, forward ? channel * kernel_height * kernel_width : kernel_count * kernel_height * kernel_width))
+    // pruned kernels only exist channel-major
+    vector<Layout> layouts() { return pruned ? vector<Layout> { NCHW } : vector<Layout> { NCHW, NHWC }; }
+
+    void setLayout(Layout layout)
     {
+        this->layout = layout;
+        if (in_size.empty())
+            return;
+        int out_len = out_size.first * out_size.second;
+        y = layout == NHWC ? Mat(out_len, kernel_size[0]) : Mat(kernel_size[0], out_len);
     }
 
+    vector<int> scratchSizes()
+    {
+        if (layout == NHWC)
+            return { (int)w.size.first * w.size.second, (int)w.size.first * w.size.second };
+        if (implicit_gemm && !pruned) // a tile of conv_tile im2col columns per pool participant
+            return { pool::threads() * in_size[0] * kernel_size[1] * kernel_size[2] * mutil::conv_tile };
+        int col_size = in_size[0] * kernel_size[1] * kernel_size[2] * out_size.first * out_size.second;
+        return { col_size, col_size, in_size[0] * kernel_size[0] * kernel_size[1] * kernel_size[2] };
+    }
+
+    long cacheSize() { return (long)x.size.first * x.size.second; }
+    void release() { x = Mat(); }
+
     Mat& forward(Mat& in)
     {
         y.clear();
-        Mat data_col(in_size[0], out_size.first * out_size.second * kernel_size[1] * kernel_size[2]);
-        mutil::im2col(in, in_size[0], in_size[1], in_size[2], { kernel_size[1], kernel_size[2] }, stride, padding, data_col);
-        for (int i = 0; i < in_size[0]; i++) {
-            Kernel col(kernel_size[1] * kernel_size[2], out_size.first * out_size.second, data_col[i]);
+        if (layout == NHWC)
+            return nhwc_forward(in);
+        if (implicit_gemm && !pruned) {
+            Mat& tiles = buffer(0, pool::threads(), in_size[0] * kernel_size[1] * kernel_size[2] * mutil::conv_tile);
+            mutil::implicit_conv(in, in_size[0], in_size[1], in_size[2], { kernel_size[1], kernel_size[2] }, stride, padding, w, kernel_size[0], y, tiles);
             for (int j = 0; j < kernel_size[0]; j++) {
-                Kernel kernel(1, kernel_size[1] * kernel_size[2], w[i * kernel_size[0] + j]);
-                Kernel out(1, out_size.first * out_size.second, y[j]);
-                mutil::multiply(kernel, col, out);
+                Kernel out(out_size.first, out_size.second, y[j]);
+                out += b[0][j];
             }
+            x = in;
+            return y;
+        }
+        Mat& data_col = buffer(0, in_size[0], out_size.first * out_size.second * kernel_size[1] * kernel_size[2]);
+        mutil::im2col(in, in_size[0], in_size[1], in_size[2], { kernel_size[1], kernel_size[2] }, stride, padding, data_col);
+        if (pruned) {
+            mutil::sparse_conv(sparse_w, data_col, kernel_size[0], out_size.first * out_size.second, y);
+        } else {
+            // output channels are independent, each task accumulates whole channels
+            long work = (long)in_size[0] * data_col.size.second;
+            pool::parallel_for(0, kernel_size[0], mutil::parallel_work / max(work, 1L), [&](long lo, long hi) {
+                for (int j = lo; j < hi; j++) {
+                    Kernel out(1, out_size.first * out_size.second, y[j]);
+                    for (int i = 0; i < in_size[0]; i++) {
+                        Kernel col(kernel_size[1] * kernel_size[2], out_size.first * out_size.second, data_col[i]);
+                        Kernel kernel(1, kernel_size[1] * kernel_size[2], w[i * kernel_size[0] + j]);
+                        mutil::multiply(kernel, col, out);
+                    }
+                }
+            });
         }
         for (int j = 0; j < kernel_size[0]; j++) {
             Kernel out(out_size.first, out_size.second, y[j]);
@@ -294,32 +751,144 @@ public:
     }
     Mat backward(Mat& in)
     {
-        Mat data_col(in_size[0], out_size.first * out_size.second * kernel_size[1] * kernel_size[2]);
-        mutil::im2col(x, in_size[0], in_size[1], in_size[2], out_size, stride, padding, data_col);
-        Mat ret_img(in_size[0], out_size.first * out_size.second * kernel_size[1] * kernel_size[2]);
-        Tensor delta_tensor({ kernel_size[0], out_size.first, out_size.second }, in);
+        if (layout == NHWC)
+            return nhwc_backward(in);
+        if (pruned)
+            return sparse_backward(in);
+        if (implicit_gemm)
+            return implicit_backward(in);
+        int channels = in_size[0], kernel_count = kernel_size[0];
+        int kernel_area = kernel_size[1] * kernel_size[2], out_len = out_size.first * out_size.second;
+        pair<int, int> ksize = { kernel_size[1], kernel_size[2] };
+        Mat& data_col = buffer(0, channels * kernel_area, out_len);
+        mutil::im2col(x, channels, in_size[1], in_size[2], ksize, stride, padding, data_col);
+        Kernel col(channels * kernel_area, out_len, data_col[0]);
+        Kernel delta(kernel_count, out_len, in[0]);
+        // w' = kernel_count x (channels * kernel_area) is w with its (channel, kernel) rows regrouped
+        Mat& w_t = buffer(2, kernel_count, channels * kernel_area);
+        w_t.clear();
+        Kernel gemm(kernel_count, channels * kernel_area, w_t[0]);
+        // dW' = dY * col^T
+        mutil::multiply_transpose(delta, col, gemm);
+        for (int i = 0; i < channels; i++) {
+            for (int j = 0; j < kernel_count; j++) {
+                copy(w_t[j] + i * kernel_area, w_t[j] + (i + 1) * kernel_area, delta_w[i * kernel_count + j]);
+            }
+        }
+        // dcol = W'^T * dY
+        for (int i = 0; i < channels; i++) {
+            for (int j = 0; j < kernel_count; j++) {
+                copy(w[i * kernel_count + j], w[i * kernel_count + j] + kernel_area, w_t[j] + i * kernel_area);
+            }
+        }
+        Mat& delta_col = buffer(1, channels * kernel_area, out_len);
+        delta_col.clear();
+        Kernel dcol(channels * kernel_area, out_len, delta_col[0]);
+        mutil::transpose_multiply(gemm, delta, dcol);
+        Mat ret(channels, in_size[1] * in_size[2]);
+        mutil::col2im(delta_col, channels, in_size[1], in_size[2], ksize, stride, padding, ret);
+        for (int j = 0; j < kernel_count; j++) {
+            float sum = 0;
+            for (int p = 0; p < out_len; p++) {
+                sum += in[j][p];
+            }
+            delta_b[j][0] = sum;
+        }
+        nabla_w += delta_w;
+        nabla_b += delta_b;
+        return ret;
+    }
+
+    // w regrouped as (kernel_height * kernel_width * channel) x kernel_count for the NHWC kernels
+    Mat& packed_weights()
+    {
+        int channels = in_size[0], kernel_count = kernel_size[0], kernel_area = kernel_size[1] * kernel_size[2];
+        Mat& w_hwc = buffer(0, kernel_area * channels, kernel_count);
+        for (int i = 0; i < channels; i++) {
+            for (int j = 0; j < kernel_count; j++) {
+                for (int t = 0; t < kernel_area; t++) {
+                    w_hwc[t * channels + i][j] = w[i * kernel_count + j][t];
+                }
+            }
+        }
+        return w_hwc;
+    }
+
+    Mat& nhwc_forward(Mat& in)
+    {
+        for (int p = 0; p < y.size.first; p++) {
+            copy(b[0], b[0] + kernel_size[0], y[p]);
+        }
+        mutil::conv_nhwc(in, in_size[0], in_size[1], in_size[2], { kernel_size[1], kernel_size[2] }, stride, padding, packed_weights(), kernel_size[0], y);
+        x = in;
+        return y;
+    }
+
+    Mat nhwc_backward(Mat& in)
+    {
+        int channels = in_size[0], kernel_count = kernel_size[0], kernel_area = kernel_size[1] * kernel_size[2];
+        Mat& w_hwc = packed_weights();
+        Mat& dw_hwc = buffer(1, kernel_area * channels, kernel_count);
+        dw_hwc.clear();
+        Mat ret(in_size[1] * in_size[2], channels);
+        mutil::conv_nhwc_prime(x, channels, in_size[1], in_size[2], { kernel_size[1], kernel_size[2] }, stride, padding, w_hwc, in, kernel_count, dw_hwc, ret);
+        for (int i = 0; i < channels; i++) {
+            for (int j = 0; j < kernel_count; j++) {
+                for (int t = 0; t < kernel_area; t++) {
+                    delta_w[i * kernel_count + j][t] = dw_hwc[t * channels + i][j];
+                }
+            }
+        }
+        delta_b.clear();
+        for (int p = 0; p < in.size.first; p++) {
+            for (int j = 0; j < kernel_count; j++) {
+                delta_b[j][0] += in[p][j];
+            }
+        }
+        nabla_w += delta_w;
+        nabla_b += delta_b;
+        return ret;
+    }
+
+    Mat implicit_backward(Mat& in)
+    {
+        pair<int, int> ksize = { kernel_size[1], kernel_size[2] };
         Mat ret(in_size[0], in_size[1] * in_size[2]);
-        ret.clear();
         delta_w.clear();
         delta_b.clear();
-        for (int i = 0; i < in_size[0]; i++) {
-            Kernel img(out_size.first * out_size.second, kernel_size[1] * kernel_size[2], data_col[i]);
-            for (int j = 0; j < kernel_size[0]; j++) {
-                Kernel dw_kernel(1, kernel_size[1] * kernel_size[2], delta_w[i * kernel_size[0] + j]);
-                Kernel in_kernel(1, out_size.first * out_size.second, delta_tensor[j]);
-                mutil::multiply(in_kernel, img, dw_kernel);
-                delta_b[j][0] += mutil::sum(in_kernel);
-                Kernel kernel(kernel_size[1] * kernel_size[2], 1, w[i * kernel_size[0] + j]);
-                Kernel out(kernel_size[1] * kernel_size[2], out_size.first * out_size.second, ret_img[i]);
-                mutil::multiply(kernel, in_kernel, out);
-            }
+        Mat& tiles = buffer(0, pool::threads(), kernel_size[1] * kernel_size[2] * mutil::conv_tile);
+        mutil::implicit_conv_prime_w(x, in_size[0], in_size[1], in_size[2], ksize, stride, padding, in, kernel_size[0], delta_w, tiles);
+        mutil::implicit_conv_prime_in(in, w, kernel_size[0], in_size[0], in_size[1], in_size[2], ksize, stride, padding, ret, tiles);
+        for (int j = 0; j < kernel_size[0]; j++) {
+            Kernel in_kernel(1, out_size.first * out_size.second, in[j]);
+            delta_b[j][0] += mutil::sum(in_kernel);
         }
-        mutil::col2im(ret_img, in_size[0], in_size[1], in_size[2], { kernel_size[1], kernel_size[2] }, stride, padding, ret);
         nabla_w += delta_w;
         nabla_b += delta_b;
         return ret;
     }
 
+    Mat sparse_backward(Mat& in)
+    {
+        int out_len = out_size.first * out_size.second;
+        Mat& data_col = buffer(0, in_size[0], out_len * kernel_size[1] * kernel_size[2]);
+        mutil::im2col(x, in_size[0], in_size[1], in_size[2], { kernel_size[1], kernel_size[2] }, stride, padding, data_col);
+        Mat& delta_col = buffer(1, in_size[0], out_len * kernel_size[1] * kernel_size[2]);
+        delta_col.clear();
+        Mat ret(in_size[0], in_size[1] * in_size[2]);
+        delta_sw.clear();
+        delta_b.clear();
+        mutil::sparse_conv_prime(sparse_w, data_col, in, kernel_size[0], out_len, delta_sw, delta_col);
+        for (int j = 0; j < kernel_size[0]; j++) {
+            Kernel in_kernel(1, out_len, in[j]);
+            delta_b[j][0] += mutil::sum(in_kernel);
+        }
+        mutil::col2im(delta_col, in_size[0], in_size[1], in_size[2], { kernel_size[1], kernel_size[2] }, stride, padding, ret);
+        nabla_sw += delta_sw;
+        nabla_b += delta_b;
+        return ret;
+    }
+
     void randomize(default_random_engine& e)
     {
         w.randomize(u, e), b.randomize(u, e);
@@ -327,20 +896,548 @@ public:
 
     void learn(Optimizer* optimizer)
     {
-        w = optimizer->optimize(w, nabla_w);
+        if (pruned) {
+            sparse_w.val = optimizer->optimize(sparse_w.val, nabla_sw);
+            nabla_sw.clear();
+        } else {
+            w = optimizer->optimize(w, nabla_w);
+            nabla_w.clear();
+        }
         b = optimizer->optimize(b, nabla_b);
-        nabla_w.clear();
         nabla_b.clear();
     }
 
+    vector<Mat*> parameters()
+    {
+        if (pruned)
+            return { &sparse_w.val, &b };
+        return { &w, &b };
+    }
+
+    vector<Mat*> gradients()
+    {
+        if (pruned)
+            return { &nabla_sw, &nabla_b };
+        return { &nabla_w, &nabla_b };
+    }
+
+    void saveState(ostream& out)
+    {
+        out.put(pruned);
+        if (pruned)
+            sparse_w.writePattern(out);
+        Layer::saveState(out);
+    }
+
+    void loadState(istream& in)
+    {
+        if (in.get()) {
+            sparse_w.readPattern(in);
+            delta_sw = Mat(1, sparse_w.nnz());
+            w = delta_w = nabla_w = Mat();
+            pruned = true;
+        } else {
+            densify();
+        }
+        Layer::loadState(in);
+    }
+
+    void prune(float sparsity)
+    {
+        if (layout == NHWC)
+            setLayout(NCHW);
+        densify();
+        sparsify(mutil::magnitude_threshold(w, sparsity));
+    }
+
+    // replaces w by its entries above threshold
+    void sparsify(float threshold)
+    {
+        sparse_w = SparseMat(w, threshold);
+        delta_sw = Mat(1, sparse_w.nnz());
+        nabla_sw = Mat(1, sparse_w.nnz());
+        w = delta_w = nabla_w = Mat();
+        pruned = true;
+    }
+
+    ChannelUse channelUse() { return CONSUMES; }
+
+    // importance of every output kernel, by the L1 norm of its weights or, with taylor, by the
+    // squared sum of weight times accumulated gradient, the first order change of the loss
+    // when the kernel is removed
+    vector<float> saliency(bool taylor)
+    {
+        Mat weight = pruned ? sparse_w.to_Mat() : w, grad = nabla_w;
+        if (pruned) {
+            SparseMat g = sparse_w; // nabla_sw follows the pattern of sparse_w
+            g.val = nabla_sw;
+            grad = g.to_Mat();
+        }
+        int kernel_count = kernel_size[0];
+        vector<double> norm(kernel_count), dot(kernel_count);
+        for (int r = 0; r < weight.size.first; r++) {
+            for (int t = 0; t < weight.size.second; t++) {
+                norm[r % kernel_count] += fabs(weight[r][t]);
+                dot[r % kernel_count] += weight[r][t] * grad[r][t];
+            }
+        }
+        vector<float> res(kernel_count);
+        for (int j = 0; j < kernel_count; j++) {
+            res[j] = taylor ? dot[j] * dot[j] : norm[j];
+        }
+        return res;
+    }
+
+    // keeps the output kernels in keep, sorted
+    void keepOutputs(const vector<int>& keep)
+    {
+        bool sparse = pruned;
+        densify();
+        int channels = in_size[0], kernel_count = kernel_size[0], kernel_area = kernel_size[1] * kernel_size[2];
+        Mat kept(channels * keep.size(), kernel_area), bias(keep.size(), 1);
+        for (int i = 0; i < channels; i++) {
+            for (int j = 0; j < keep.size(); j++) {
+                copy(w[i * kernel_count + keep[j]], w[i * kernel_count + keep[j]] + kernel_area, kept[i * keep.size() + j]);
+            }
+        }
+        for (int j = 0; j < keep.size(); j++) {
+            bias[0][j] = b[0][keep[j]];
+        }
+        kernel_size[0] = keep.size();
+        resize(kept, bias);
+        if (sparse)
+            sparsify(0);
+    }
+
+    void keepInputs(const vector<int>& keep, int area)
+    {
+        bool sparse = pruned;
+        densify();
+        int kernel_count = kernel_size[0], kernel_area = kernel_size[1] * kernel_size[2];
+        Mat kept(keep.size() * kernel_count, kernel_area);
+        for (int i = 0; i < keep.size(); i++) {
+            for (int j = 0; j < kernel_count; j++) {
+                copy(w[keep[i] * kernel_count + j], w[keep[i] * kernel_count + j] + kernel_area, kept[i * kernel_count + j]);
+            }
+        }
+        in_size[0] = keep.size();
+        resize(kept, b);
+        if (sparse)
+            sparsify(0);
+    }
+
+    // new weights and bias with gradients to match, build() then keeps them
+    void resize(Mat& weight, Mat& bias)
+    {
+        w = weight, b = bias;
+        delta_w = Mat(w.size.first, w.size.second), nabla_w = Mat(w.size.first, w.size.second);
+        delta_b = Mat(b.size.first, 1), nabla_b = Mat(b.size.first, 1);
+        x = Mat();
+    }
+
+    long multiplyAdds()
+    {
+        long per_position = pruned ? sparse_w.nnz() : (long)w.size.first * w.size.second;
+        return per_position * out_size.first * out_size.second;
+    }
+
+    void densify()
+    {
+        if (!pruned)
+            return;
+        w = sparse_w.to_Mat();
+        delta_w = Mat(w.size.first, w.size.second);
+        nabla_w = Mat(w.size.first, w.size.second);
+        sparse_w = SparseMat();
+        delta_sw = nabla_sw = Mat();
+        pruned = false;
+    }
+
+    // output channel j becomes channel j * scale[j] + shift[j], for folding a following normalization
+    void scaleOutputs(Mat& scale, Mat& shift)
+    {
+        int kernel_count = kernel_size[0];
+        if (pruned) {
+            for (int r = 0; r < sparse_w.size.first; r++) {
+                for (int k = sparse_w.row_ptr[r]; k < sparse_w.row_ptr[r + 1]; k++) {
+                    sparse_w.val[0][k] *= scale[0][r % kernel_count];
+                }
+            }
+        } else {
+            for (int r = 0; r < w.size.first; r++) {
+                for (int t = 0; t < w.size.second; t++) {
+                    w[r][t] *= scale[0][r % kernel_count];
+                }
+            }
+        }
+        for (int j = 0; j < kernel_count; j++) {
+            b[0][j] = b[0][j] * scale[0][j] + shift[0][j];
+        }
+    }
+
     void saveCheckpoint(ofstream& ofstream)
     {
-        ofstream << w << b;
+        if (pruned)
+            ofstream << sparse_w << b;
+        else
+            ofstream << w << b;
+    }
+
+    void emitWeights(ostream& out, string prefix)
+    {
+        Mat weight = pruned ? sparse_w.to_Mat() : w;
+        emitArray(out, prefix + "_w", weight);
+        emitArray(out, prefix + "_b", b);
+    }
+
+    bool emitForward(ostream& out, string prefix, vector<int> shape)
+    {
+        if (layout != NCHW)
+            return false;
+        int C = in_size[0], H = in_size[1], W = in_size[2], K = kernel_size[0], KH = kernel_size[1], KW = kernel_size[2];
+        int OH = out_size.first, OW = out_size.second;
+        out << "    for (int k = 0; k < " << K << "; k++)\n";
+        out << "        for (int p = 0; p < " << OH * OW << "; p++)\n";
+        out << "            dst[k * " << OH * OW << " + p] = " << prefix << "_b[k];\n";
+        out << "    for (int c = 0; c < " << C << "; c++)\n";
+        out << "        for (int k = 0; k < " << K << "; k++)\n";
+        out << "            for (int kh = 0; kh < " << KH << "; kh++)\n";
+        out << "                for (int kw = 0; kw < " << KW << "; kw++) {\n";
+        out << "                    float v = " << prefix << "_w[(c * " << K << " + k) * " << KH * KW << " + kh * " << KW << " + kw];\n";
+        out << "                    for (int oh = 0; oh < " << OH << "; oh++)\n";
+        out << "                        for (int ow = 0; ow < " << OW << "; ow++) {\n";
+        out << "                            int ih = oh * " << stride << " + kh - " << padding << ", iw = ow * " << stride << " + kw - " << padding << ";\n";
+        if (padding)
+            out << "                            if (ih >= 0 && ih < " << H << " && iw >= 0 && iw < " << W << ")\n    ";
+        out << "                            dst[k * " << OH * OW << " + oh * " << OW << " + ow] += v * src[c * " << H * W << " + ih * " << W << " + iw];\n";
+        out << "                        }\n";
+        out << "                }\n";
+        return true;
+    }
+
+    function<void(ofstream&)> snapshot()
+    {
+        Mat bias = b;
+        if (pruned) {
+            SparseMat weight = sparse_w;
+            return [weight, bias](ofstream& ofstream) { ofstream << weight << bias; };
+        }
+        Mat weight = w;
+        return [weight, bias](ofstream& ofstream) { ofstream << weight << bias; };
     }
 
     void loadCheckpoint(ifstream& ifstream)
     {
-        ifstream >> w >> b;
+        ifstream >> ws;
+        if (ifstream.peek() == 'c') {
+            ifstream >> sparse_w;
+            delta_sw = Mat(1, sparse_w.nnz());
+            nabla_sw = Mat(1, sparse_w.nnz());
+            w = delta_w = nabla_w = Mat();
+            pruned = true;
+        } else {
+            densify();
+            ifstream >> w;
+        }
+        ifstream >> b;
+    }
+};
+
+// batch normalization: every channel to gamma (x - mean) / sqrt(var + epsilon) + beta. layers
+// see one sample at a time, so Network::train runs a batch up to the layer, hands all of it to
+// batchForward to normalize with the statistics of the channel over every sample and position,
+// and later hands the batch's gradients to batchBackward, which flows back through those
+// statistics. a flat { 1, 1, n } input, such as a DenseLayer output, has n channels of one
+// position. the batch statistics are blended into running averages that forward() of a single
+// sample normalizes with, so the layer is a fixed affine map for inference and
+// Network::foldBatchNorm folds it into a preceding ConvLayer or DenseLayer
+class BatchNormLayer : public Layer {
+    Mat x; // input of forward()
+    vector<Mat> xs; // inputs of batchForward()
+    int channels = 0, area = 0;
+    bool flat = false;
+    bool batched = false; // batchForward normalized with the batch statistics
+    vector<float> mean, inv; // normalization of the last forward, per channel
+    long batches = 0;
+
+public:
+    float momentum, epsilon;
+    Mat gamma, beta;
+    Mat nabla_gamma, nabla_beta;
+    Mat running_mean, running_var;
+
+    BatchNormLayer(float momentum = 0.1, float epsilon = 1e-5)
+        : momentum(momentum)
+        , epsilon(epsilon)
+    {
+    }
+
+    vector<int> build(vector<int> shape)
+    {
+        flat = shape[0] == 1 && shape[1] == 1;
+        int c = flat ? shape[2] : shape[0];
+        area = flat ? 1 : shape[1] * shape[2];
+        if (c != channels) {
+            channels = c;
+            gamma = Mat(1, c), beta = Mat(1, c);
+            nabla_gamma = Mat(1, c), nabla_beta = Mat(1, c);
+            running_mean = Mat(1, c), running_var = Mat(1, c);
+            for (int j = 0; j < c; j++) {
+                gamma[0][j] = running_var[0][j] = 1;
+            }
+            batches = 0;
+        }
+        return shape;
+    }
+
+    vector<Layout> layouts() { return {}; }
+    ChannelUse channelUse() { return PASSES; }
+
+    void keepInputs(const vector<int>& keep, int area)
+    {
+        vector<int> kept = flat ? expandChannels(keep, area) : keep;
+        for (auto mat : { &gamma, &beta, &nabla_gamma, &nabla_beta, &running_mean, &running_var }) {
+            Mat res(1, kept.size());
+            for (int j = 0; j < kept.size(); j++) {
+                res[0][j] = (*mat)[0][kept[j]];
+            }
+            *mat = res;
+        }
+        channels = kept.size();
+        release();
+    }
+
+    long cacheSize()
+    {
+        long total = (long)x.size.first * x.size.second;
+        for (auto& in : xs) {
+            total += (long)in.size.first * in.size.second;
+        }
+        return total;
+    }
+
+    void release()
+    {
+        x = Mat();
+        xs.clear();
+    }
+
+    // the affine map inference applies, y = x * scale + shift
+    void affine(Mat& scale, Mat& shift)
+    {
+        scale = Mat(1, channels), shift = Mat(1, channels);
+        for (int j = 0; j < channels; j++) {
+            scale[0][j] = gamma[0][j] / sqrt(running_var[0][j] + epsilon);
+            shift[0][j] = beta[0][j] - running_mean[0][j] * scale[0][j];
+        }
+    }
+
+    // channel of the i-th stored value
+    int channel(long i)
+    {
+        return layout == NHWC ? i % channels : i / area;
+    }
+
+    void useRunningAverages()
+    {
+        mean.resize(channels), inv.resize(channels);
+        for (int c = 0; c < channels; c++) {
+            mean[c] = running_mean[0][c];
+            inv[c] = 1 / sqrt(running_var[0][c] + epsilon);
+        }
+    }
+
+    void normalize(Mat& in)
+    {
+        long n = (long)channels * area;
+        auto v = in[0];
+        for (long i = 0; i < n; i++) {
+            int c = channel(i);
+            v[i] = (v[i] - mean[c]) * inv[c] * gamma[0][c] + beta[0][c];
+        }
+    }
+
+    // one sample, normalized with the running averages
+    Mat& forward(Mat& in)
+    {
+        x = in;
+        useRunningAverages();
+        normalize(in);
+        return in;
+    }
+
+    // the statistics are constants here, dx = gamma / sigma dy
+    Mat backward(Mat& in)
+    {
+        long n = (long)channels * area;
+        auto d = in[0], v = x[0];
+        Mat ret(in.size.first, in.size.second);
+        auto res = ret[0];
+        for (long i = 0; i < n; i++) {
+            int c = channel(i);
+            res[i] = d[i] * gamma[0][c] * inv[c];
+            nabla_gamma[0][c] += d[i] * (v[i] - mean[c]) * inv[c];
+            nabla_beta[0][c] += d[i];
+        }
+        return ret;
+    }
+
+    // normalizes every sample of the batch in place with the batch statistics and blends them
+    // into the running averages. a batch with a single value per channel has no variance, it
+    // uses the running averages like forward()
+    void batchForward(vector<Mat>& batch)
+    {
+        xs = batch;
+        long n = (long)channels * area, count = (long)batch.size() * area;
+        batched = count > 1;
+        if (!batched) {
+            useRunningAverages();
+        } else {
+            vector<double> total(channels), total_sq(channels);
+            for (auto& in : batch) {
+                auto v = in[0];
+                for (long i = 0; i < n; i++) {
+                    total[channel(i)] += v[i];
+                    total_sq[channel(i)] += (double)v[i] * v[i];
+                }
+            }
+            mean.resize(channels), inv.resize(channels);
+            float m = batches ? momentum : 1;
+            for (int c = 0; c < channels; c++) {
+                double mu = total[c] / count, sigma = max(0.0, total_sq[c] / count - mu * mu);
+                mean[c] = mu;
+                inv[c] = 1 / sqrt(sigma + epsilon);
+                // the running variance is the unbiased estimate
+                running_mean[0][c] += m * (mu - running_mean[0][c]);
+                running_var[0][c] += m * (sigma * count / (count - 1) - running_var[0][c]);
+            }
+            batches++;
+        }
+        for (auto& in : batch) {
+            normalize(in);
+        }
+    }
+
+    // turns the gradients of the batchForward outputs into those of its inputs, in place:
+    // dx = gamma / sigma (dy - mean(dy) - x^ mean(dy x^)), the means over the channel in the batch
+    void batchBackward(vector<Mat>& deltas)
+    {
+        int samples = deltas.size();
+        long n = (long)channels * area, count = (long)samples * area;
+        vector<double> sum_d(channels), sum_dx(channels);
+        for (int s = 0; s < samples; s++) {
+            auto d = deltas[s][0], v = xs[s][0];
+            for (long i = 0; i < n; i++) {
+                int c = channel(i);
+                sum_d[c] += d[i];
+                sum_dx[c] += d[i] * (v[i] - mean[c]) * inv[c];
+            }
+        }
+        for (int s = 0; s < samples; s++) {
+            auto d = deltas[s][0], v = xs[s][0];
+            for (long i = 0; i < n; i++) {
+                int c = channel(i);
+                float g = d[i];
+                if (batched)
+                    g -= (sum_d[c] + (v[i] - mean[c]) * inv[c] * sum_dx[c]) / count;
+                d[i] = g * gamma[0][c] * inv[c];
+            }
+        }
+        for (int c = 0; c < channels; c++) {
+            nabla_gamma[0][c] += sum_dx[c];
+            nabla_beta[0][c] += sum_d[c];
+        }
+        xs.clear();
+    }
+
+    void randomize(default_random_engine& e)
+    {
+        for (int j = 0; j < channels; j++) {
+            gamma[0][j] = 1, beta[0][j] = 0;
+        }
+    }
+
+    void learn(Optimizer* optimizer)
+    {
+        gamma = optimizer->optimize(gamma, nabla_gamma);
+        nabla_gamma.clear();
+        beta = optimizer->optimize(beta, nabla_beta);
+        nabla_beta.clear();
+    }
+
+    vector<Mat*> parameters() { return { &gamma, &beta }; }
+    vector<Mat*> gradients() { return { &nabla_gamma, &nabla_beta }; }
+
+    void saveState(ostream& out)
+    {
+        Layer::saveState(out);
+        running_mean.write(out);
+        running_var.write(out);
+        out.write((char*)&batches, sizeof(batches));
+    }
+
+    void loadState(istream& in)
+    {
+        Layer::loadState(in);
+        running_mean.read(in);
+        running_var.read(in);
+        in.read((char*)&batches, sizeof(batches));
+    }
+
+    void saveCheckpoint(ofstream& ofstream)
+    {
+        ofstream << gamma << beta << running_mean << running_var;
+    }
+
+    void loadCheckpoint(ifstream& ifstream)
+    {
+        ifstream >> gamma >> beta >> running_mean >> running_var;
+        batches = max(batches, 1L);
+    }
+
+    function<void(ofstream&)> snapshot()
+    {
+        Mat g = gamma, b = beta, m = running_mean, v = running_var;
+        return [g, b, m, v](ofstream& ofstream) { ofstream << g << b << m << v; };
+    }
+
+    void emitWeights(ostream& out, string prefix)
+    {
+        Mat scale, shift;
+        affine(scale, shift);
+        emitArray(out, prefix + "_scale", scale);
+        emitArray(out, prefix + "_shift", shift);
+    }
+
+    bool emitForward(ostream& out, string prefix, vector<int> shape)
+    {
+        if (layout != NCHW)
+            return false;
+        out << "    for (int c = 0; c < " << channels << "; c++)\n";
+        out << "        for (int p = 0; p < " << area << "; p++)\n";
+        out << "            dst[c * " << area << " + p] = src[c * " << area << " + p] * " << prefix << "_scale[c] + " << prefix << "_shift[c];\n";
+        return true;
+    }
+
+    // folds the inference normalization into the layer producing its input, false if that
+    // isn't a ConvLayer or DenseLayer with one output per channel
+    bool foldInto(Layer* layer)
+    {
+        Mat scale, shift;
+        affine(scale, shift);
+        if (auto conv = dynamic_cast<ConvLayer*>(layer)) {
+            if (flat || conv->b.size.first != channels)
+                return false;
+            conv->scaleOutputs(scale, shift);
+            return true;
+        }
+        if (auto dense = dynamic_cast<DenseLayer*>(layer)) {
+            if (dense->out != channels)
+                return false;
+            dense->scaleOutputs(scale, shift);
+            return true;
+        }
+        return false;
     }
 };
 
@@ -362,60 +1459,118 @@ protected:
 
 public:
     PoolingLayer(int height, int width, int channel, pair<int, int> size, int stride, Type type = MAX)
-        : x(channel, height * width)
-        , y(channel, height * width)
-        , pool_size(size)
+        : PoolingLayer(size, stride, type)
+    {
+        build({ channel, height, width });
+    }
+
+    // input shape is inferred by Network::build
+    PoolingLayer(pair<int, int> size, int stride, Type type = MAX)
+        : pool_size(size)
         , stride(stride)
         , type(type)
     {
-        in_size = { channel, height, width };
-        out_size = mutil::compute_output_size(in_size[1], in_size[2], size.first, size.second, stride, 0);
-        y = Mat(channel, out_size.first * out_size.second);
+    }
+
+    vector<int> build(vector<int> shape)
+    {
+        in_size = shape;
+        out_size = mutil::compute_output_size(in_size[1], in_size[2], pool_size.first, pool_size.second, stride, 0);
+        setLayout(layout);
+        return { in_size[0], out_size.first, out_size.second };
+    }
+
+    vector<Layout> layouts() { return { NCHW, NHWC }; }
+    ChannelUse channelUse() { return PASSES; }
+
+    void setLayout(Layout layout)
+    {
+        this->layout = layout;
+        if (in_size.empty())
+            return;
+        int out_len = out_size.first * out_size.second;
+        y = layout == NHWC ? Mat(out_len, in_size[0]) : Mat(in_size[0], out_len);
+    }
+
+    long cacheSize() { return (long)x.size.first * x.size.second; }
+    void release() { x = Mat(); }
+
+    bool emitForward(ostream& out, string prefix, vector<int> shape)
+    {
+        if (layout != NCHW)
+            return false;
+        int H = in_size[1], W = in_size[2], OH = out_size.first, OW = out_size.second;
+        out << "    for (int c = 0; c < " << in_size[0] << "; c++)\n";
+        out << "        for (int oh = 0; oh < " << OH << "; oh++)\n";
+        out << "            for (int ow = 0; ow < " << OW << "; ow++) {\n";
+        out << "                float r = " << (type == MAX ? "-FLT_MAX" : "0") << ";\n";
+        out << "                for (int kh = 0; kh < " << pool_size.first << "; kh++)\n";
+        out << "                    for (int kw = 0; kw < " << pool_size.second << "; kw++) {\n";
+        out << "                        int ih = oh * " << stride << " + kh, iw = ow * " << stride << " + kw;\n";
+        out << "                        if (ih < " << H << " && iw < " << W << ")\n";
+        if (type == MAX)
+            out << "                            r = std::max(r, src[c * " << H * W << " + ih * " << W << " + iw]);\n";
+        else
+            out << "                            r += src[c * " << H * W << " + ih * " << W << " + iw];\n";
+        out << "                    }\n";
+        out << "                dst[c * " << OH * OW << " + oh * " << OW << " + ow] = r" << (type == MAX ? "" : " / " + to_string(pool_size.first * pool_size.second)) << ";\n";
+        out << "            }\n";
+        return true;
     }
 
     Mat& forward(Mat& in)
     {
-        Tensor tensor(in_size, in);
         y.clear();
-        if (type == MAX) {
-            for (int i = 0; i < in_size[0]; i++) {
-                Kernel img(in_size[1], in_size[2], tensor[i]);
-                Kernel out(out_size.first, out_size.second, y[i]);
-                mutil::max_pooling(img, out, pool_size, stride);
-            }
+        x = in;
+        if (layout == NHWC) {
+            if (type == MAX)
+                mutil::max_pooling_nhwc(in, in_size[0], in_size[1], in_size[2], pool_size, stride, y);
+            if (type == MEAN)
+                mutil::mean_pooling_nhwc(in, in_size[0], in_size[1], in_size[2], pool_size, stride, y);
+            return y;
         }
-        if (type == MEAN) {
-            for (int i = 0; i < in_size[0]; i++) {
+        Tensor tensor(in_size, in);
+        long grain = mutil::parallel_work / max(in_size[1] * in_size[2], 1);
+        pool::parallel_for(0, in_size[0], grain, [&](long lo, long hi) {
+            for (int i = lo; i < hi; i++) {
                 Kernel img(in_size[1], in_size[2], tensor[i]);
                 Kernel out(out_size.first, out_size.second, y[i]);
-                mutil::mean_pooling(img, out, pool_size, stride);
+                if (type == MAX)
+                    mutil::max_pooling(img, out, pool_size, stride);
+                if (type == MEAN)
+                    mutil::mean_pooling(img, out, pool_size, stride);
             }
-        }
-        x = in;
+        });
         return y;
     }
 
     Mat backward(Mat& in)
     {
+        if (layout == NHWC) {
+            Mat ret(in_size[1] * in_size[2], in_size[0]);
+            if (type == MAX)
+                mutil::max_pooling_nhwc_prime(x, in, in_size[0], in_size[1], in_size[2], pool_size, stride, ret);
+            if (type == MEAN)
+                mutil::mean_pooling_nhwc_prime(in, in_size[0], in_size[1], in_size[2], pool_size, stride, ret);
+            return ret;
+        }
         Tensor img_tensor(in_size, x);
         Tensor delta_tensor({ in_size[0], out_size.first, out_size.second }, in);
         Mat ret(in_size[0], in_size[1] * in_size[2]);
         ret.clear();
-        if (type == MAX) {
-            for (int i = 0; i < in_size[0]; i++) {
-                Kernel img(in_size[1], in_size[2], img_tensor[i]);
+        long grain = mutil::parallel_work / max(in_size[1] * in_size[2], 1);
+        pool::parallel_for(0, in_size[0], grain, [&](long lo, long hi) {
+            for (int i = lo; i < hi; i++) {
                 Kernel delta(out_size.first, out_size.second, delta_tensor[i]);
                 Kernel out(in_size[1], in_size[2], ret[i]);
-                mutil::max_pooling_prime(img, delta, out, pool_size, stride);
+                if (type == MAX) {
+                    Kernel img(in_size[1], in_size[2], img_tensor[i]);
+                    mutil::max_pooling_prime(img, delta, out, pool_size, stride);
+                }
+                if (type == MEAN)
+                    mutil::mean_pooling_prime(delta, out, pool_size, stride);
             }
-        }
-        if (type == MEAN) {
-            for (int i = 0; i < in_size[0]; i++) {
-                Kernel delta(out_size.first, out_size.second, delta_tensor[i]);
-                Kernel out(in_size[1], in_size[2], ret[i]);
-                mutil::mean_pooling_prime(delta, out, pool_size, stride);
-            }
-        }
+        });
         return ret;
     }
 
@@ -447,6 +1602,22 @@ public:
         mutil::softmax(in);
         return in;
     }
+
+    bool emitForward(ostream& out, string prefix, vector<int> shape)
+    {
+        int n = shape[1] * shape[2];
+        out << "    for (int c = 0; c < " << shape[0] << "; c++) {\n";
+        out << "        const float* row = src + c * " << n << ";\n";
+        out << "        float m = row[0], sum = 0;\n";
+        out << "        for (int i = 1; i < " << n << "; i++)\n";
+        out << "            m = std::max(m, row[i]);\n";
+        out << "        for (int i = 0; i < " << n << "; i++)\n";
+        out << "            sum += dst[c * " << n << " + i] = std::exp(row[i] - m);\n";
+        out << "        for (int i = 0; i < " << n << "; i++)\n";
+        out << "            dst[c * " << n << " + i] /= sum;\n";
+        out << "    }\n";
+        return true;
+    }
     Mat backward(Mat& in)
     {
         return in;
@@ -471,10 +1642,12 @@ public:
 
 class RNNLayer : public LinearLayer {
 protected:
-    Mat h, h0;
+    Mat h;
     init::Initializer* u;
     ActivationLayer* ac;
     int hidden_size;
+    autograd::Tape tape;
+    int xv, yv;
 
 public:
     Mat wi, wh, b;
@@ -484,7 +1657,6 @@ public:
         : LinearLayer(in_size, hidden_size)
         , hidden_size(hidden_size)
         , h(1, hidden_size)
-        , h0(1, hidden_size)
         , wi(in_size, hidden_size)
         , wh(hidden_size, hidden_size)
         , b(1, hidden_size)
@@ -504,23 +1676,33 @@ public:
     {
     }
 
+    vector<int> build(vector<int> shape)
+    {
+        assert(shape[0] * shape[1] * shape[2] == in);
+        return { 1, 1, out };
+    }
+
+    bool stateful() { return true; }
+
     Mat& forward(Mat& in)
     {
         h = y;
-        y = (h * wh) + (in * wi) + b; // concat or plus
-        ac->forward(y);
+        x = in;
+        tape.clear();
+        xv = tape.input(x);
+        int hv = tape.input(h);
+        int pre = tape.add(tape.add(tape.matmul(hv, tape.param(wh, delta_wh)), tape.matmul(xv, tape.param(wi, delta_wi))), tape.param(b, delta_b));
+        yv = tape.custom("activation", pre, [this](Mat& m) { return ac->forward(m); }, [this](Mat& g) { return ac->backward(g); });
+        y = tape.value(yv);
         return y;
     }
     Mat backward(Mat& in)
     {
-        Mat delta_h_prime = ac->backward(in);
-        delta_wi = x.transpose() * delta_h_prime;
-        delta_wh = h0.transpose() * delta_h_prime;
-        delta_b = delta_h_prime;
+        tape.backward(yv, in);
         nabla_wi += delta_wi;
         nabla_wh += delta_wh;
         nabla_b += delta_b;
-        return delta_h_prime * wi.transpose();
+        return tape.grad(xv);
     }
     void randomize(default_random_engine& e)
     {
@@ -535,10 +1717,23 @@ public:
         nabla_wh.clear();
         nabla_b.clear();
     }
+    vector<Mat*> parameters()
+    {
+        return { &wi, &wh, &b };
+    }
+    vector<Mat*> gradients()
+    {
+        return { &nabla_wi, &nabla_wh, &nabla_b };
+    }
     void saveCheckpoint(ofstream& ofstream)
     {
         ofstream << wi << wh << b;
     }
+    function<void(ofstream&)> snapshot()
+    {
+        Mat input = wi, hidden = wh, bias = b;
+        return [input, hidden, bias](ofstream& ofstream) { ofstream << input << hidden << bias; };
+    }
     void loadCheckpoint(ifstream& ifstream)
     {
         ifstream >> wi >> wh >> b;
@@ -547,47 +1742,26 @@ public:
 
 class LSTMLayer : public LinearLayer {
 protected:
-    Mat h, c, c0;
-    Mat f, i, ct, o;
+    Mat hp, cp, c, tc, gates; // per-timestep caches, one row per step
     init::Initializer* u;
     int hidden_size;
 
 public:
-    Mat wf, wi, wc, wo, bf, bi, bo, bc;
-    Mat delta_wf, delta_wi, delta_wc, delta_wo, delta_bf, delta_bi, delta_bo, delta_bc;
-    Mat nabla_wf, nabla_wi, nabla_wc, nabla_wo, nabla_bf, nabla_bi, nabla_bo, nabla_bc;
+    Mat w, b; // gates fused as [i | f | o | g], rows of w ordered as concat(h, x)
+    Mat delta_w, delta_b;
+    Mat nabla_w, nabla_b;
     LSTMLayer(int in_size, int hidden_size, init::Initializer* u)
         : LinearLayer(in_size, hidden_size)
         , hidden_size(hidden_size)
-        , h(1, hidden_size)
-        , c(1, hidden_size)
-        , c0(1, hidden_size)
-        , wf(in_size + hidden_size, hidden_size)
-        , wi(in_size + hidden_size, hidden_size)
-        , wc(in_size + hidden_size, hidden_size)
-        , wo(in_size + hidden_size, hidden_size)
-        , bf(1, hidden_size)
-        , bi(1, hidden_size)
-        , bc(1, hidden_size)
-        , bo(1, hidden_size)
-        , delta_wf(in_size + hidden_size, hidden_size)
-        , delta_wi(in_size + hidden_size, hidden_size)
-        , delta_wc(in_size + hidden_size, hidden_size)
-        , delta_wo(in_size + hidden_size, hidden_size)
-        , delta_bf(1, hidden_size)
-        , delta_bi(1, hidden_size)
-        , delta_bc(1, hidden_size)
-        , delta_bo(1, hidden_size)
-        , nabla_wf(in_size + hidden_size, hidden_size)
-        , nabla_wi(in_size + hidden_size, hidden_size)
-        , nabla_wc(in_size + hidden_size, hidden_size)
-        , nabla_wo(in_size + hidden_size, hidden_size)
-        , nabla_bf(1, hidden_size)
-        , nabla_bi(1, hidden_size)
-        , nabla_bc(1, hidden_size)
-        , nabla_bo(1, hidden_size)
+        , w(hidden_size + in_size, 4 * hidden_size)
+        , b(1, 4 * hidden_size)
+        , delta_w(hidden_size + in_size, 4 * hidden_size)
+        , delta_b(1, 4 * hidden_size)
+        , nabla_w(hidden_size + in_size, 4 * hidden_size)
+        , nabla_b(1, 4 * hidden_size)
         , u(u)
     {
+        nabla_w.clear(), nabla_b.clear();
     }
 
     LSTMLayer(int in_size, int hidden_size, init::Type type = init::KAIMING) // unsafe
@@ -595,51 +1769,144 @@ public:
     {
     }
 
+    ~LSTMLayer()
+    {
+        delete u;
+    }
+
+    // one timestep per row
+    vector<int> build(vector<int> shape)
+    {
+        assert(shape[1] * shape[2] == in);
+        return { shape[0], 1, out };
+    }
+
+    long cacheSize()
+    {
+        long steps = gates.size.first;
+        return (long)x.size.first * x.size.second + steps * 8 * hidden_size;
+    }
+
+    void release()
+    {
+        x = hp = cp = c = tc = gates = Mat();
+    }
+
+    // in holds a whole sequence with one timestep per row, the state starts from zero
     Mat& forward(Mat& in)
     {
+        int steps = in.size.first, H = hidden_size;
         x = in;
-        h = y;
-        c0 = c;
-        Mat cat = mutil::concat(h, x);
-        f = cat * wf + bf;
-        mutil::sigmoid(f);
-        i = cat * wi + bf;
-        mutil::sigmoid(i);
-        ct = cat * wc + bf;
-        mutil::tanh(ct);
-        o = cat * wo + bf;
-        mutil::sigmoid(o);
-        c = f.dot(c0) + i.dot(ct);
-        y = o.dot(c);
+        gates = Mat(steps, 4 * H);
+        hp = Mat(steps, H), cp = Mat(steps, H), c = Mat(steps, H), tc = Mat(steps, H);
+        y = Mat(steps, H);
+        Kernel xs(steps, this->in, x[0]);
+        Kernel wx(this->in, 4 * H, w[H]);
+        Kernel g(steps, 4 * H, gates[0]);
+        mutil::multiply(xs, wx, g);
+        Kernel wh(H, 4 * H, w[0]);
+        for (int t = 0; t < steps; t++) {
+            if (t > 0) {
+                copy(y[t - 1], y[t - 1] + H, hp[t]);
+                copy(c[t - 1], c[t - 1] + H, cp[t]);
+                Kernel h(1, H, hp[t]);
+                Kernel gt(1, 4 * H, gates[t]);
+                mutil::multiply(h, wh, gt);
+            }
+            auto gi = gates[t];
+            for (int j = 0; j < 4 * H; j++) {
+                gi[j] += b[0][j];
+            }
+            mutil::lstm_gates(gi, H);
+            auto gf = gi + H, go = gi + 2 * H, gg = gi + 3 * H;
+            for (int j = 0; j < H; j++) {
+                c[t][j] = gf[j] * cp[t][j] + gi[j] * gg[j];
+            }
+            simd::tanh(&*c[t], &*tc[t], H);
+            for (int j = 0; j < H; j++) {
+                y[t][j] = go[j] * tc[t][j];
+            }
+        }
         return y;
     }
 
+    // full BPTT over the sequence of the last forward
     Mat backward(Mat& in)
     {
-        Mat delta_h_prime = in;
-        Mat delta_c_prime = delta_h_prime * wo.transpose() * mutil::tanh_prime(c);
-        Mat delta_f_prime = delta_c_prime.dot(c0) * mutil::sigmoid_prime(c);
-        Mat delta_i_prime = delta_c_prime.dot(c) * mutil::sigmoid_prime(c);
-        Mat delta_ct_prime = delta_c_prime.dot(i) * mutil::tanh_prime(ct);
-        Mat delta_o_prime = delta_h_prime.dot(c) * mutil::sigmoid_prime(o);
-        delta_wf = mutil::concat(h, x).transpose() * delta_f_prime;
-        delta_wi = mutil::concat(h, x).transpose() * delta_i_prime;
-        delta_wc = mutil::concat(h, x).transpose() * delta_ct_prime;
-        delta_wo = mutil::concat(h, x).transpose() * delta_o_prime;
-        delta_bf = delta_f_prime;
-        delta_bi = delta_i_prime;
-        delta_bc = delta_ct_prime;
-        delta_bo = delta_o_prime;
-        nabla_wf += delta_wf;
-        nabla_wi += delta_wi;
-        nabla_wc += delta_wc;
-        nabla_wo += delta_wo;
-        nabla_bf += delta_bf;
-        nabla_bi += delta_bi;
-        nabla_bc += delta_bc;
-        nabla_bo += delta_bo;
-        return delta_h_prime * wf.transpose() + delta_c_prime * f + delta_i_prime * ct + delta_o_prime * c;
+        int steps = in.size.first, H = hidden_size;
+        Mat wt = w.transpose();
+        Mat dgates(steps, 4 * H), dcat(steps, H + this->in), dc(1, H);
+        Kernel wtk(4 * H, H + this->in, wt[0]);
+        for (int t = steps - 1; t >= 0; t--) {
+            auto gi = gates[t], gf = gi + H, go = gi + 2 * H, gg = gi + 3 * H;
+            auto di = dgates[t], df = di + H, dout = di + 2 * H, dg = di + 3 * H;
+            for (int j = 0; j < H; j++) {
+                float dh = in[t][j] + (t + 1 < steps ? dcat[t + 1][j] : 0);
+                float dct = dh * go[j] * (1 - tc[t][j] * tc[t][j]) + dc[0][j];
+                dout[j] = dh * tc[t][j] * go[j] * (1 - go[j]);
+                df[j] = dct * cp[t][j] * gf[j] * (1 - gf[j]);
+                di[j] = dct * gg[j] * gi[j] * (1 - gi[j]);
+                dg[j] = dct * gi[j] * (1 - gg[j] * gg[j]);
+                dc[0][j] = dct * gf[j];
+            }
+            Kernel dgt(1, 4 * H, dgates[t]);
+            Kernel out(1, H + this->in, dcat[t]);
+            mutil::multiply(dgt, wtk, out);
+        }
+        delta_w = mutil::concat(hp, x).transpose() * dgates;
+        delta_b.clear();
+        for (int t = 0; t < steps; t++) {
+            for (int j = 0; j < 4 * H; j++) {
+                delta_b[0][j] += dgates[t][j];
+            }
+        }
+        nabla_w += delta_w;
+        nabla_b += delta_b;
+        Mat ret(steps, this->in);
+        for (int t = 0; t < steps; t++) {
+            copy(dcat[t] + H, dcat[t] + H + this->in, ret[t]);
+        }
+        return ret;
+    }
+
+    void randomize(default_random_engine& e)
+    {
+        w.randomize(u, e), b.randomize(u, e);
+    }
+
+    void learn(Optimizer* optimizer)
+    {
+        w = optimizer->optimize(w, nabla_w);
+        b = optimizer->optimize(b, nabla_b);
+        nabla_w.clear();
+        nabla_b.clear();
+    }
+
+    vector<Mat*> parameters()
+    {
+        return { &w, &b };
+    }
+
+    vector<Mat*> gradients()
+    {
+        return { &nabla_w, &nabla_b };
+    }
+
+    void saveCheckpoint(ofstream& ofstream)
+    {
+        ofstream << w << b;
+    }
+
+    function<void(ofstream&)> snapshot()
+    {
+        Mat weight = w, bias = b;
+        return [weight, bias](ofstream& ofstream) { ofstream << weight << bias; };
+    }
+
+    void loadCheckpoint(ifstream& ifstream)
+    {
+        ifstream >> w >> b;
     }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,10 +1,14 @@
+#include "augment.cpp"
 #include "bmp_loader.cpp"
+#include "dataset.cpp"
 #include "debug.cpp"
 #include "mnist_loader.cpp"
 #include "network.cpp"
 #include "optimizer.cpp"
+#include "server.cpp"
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <random>
 #include <time.h>
 #include <vector>
@@ -13,36 +17,51 @@
 using namespace std;
 using namespace mutil;
 
-void train()
+// the LeNet5 configuration every entry point trains, loads or serves
+Network* lenet5()
 {
-    vector<Mat> train_image = read_mnist_images("./train-images.idx3-ubyte");
-    vector<int> train_label = read_mnist_labels("./train-labels.idx1-ubyte");
-
-    vector<Mat> test_image = read_mnist_images("./t10k-images.idx3-ubyte");
-    vector<int> test_label = read_mnist_labels("./t10k-labels.idx1-ubyte");
+    return new Network({ new ConvLayer(5, 5, 6, 1, 0),
+                           new RELULayer(),
+                           new PoolingLayer({ 2, 2 }, 2),
+                           new ConvLayer(5, 5, 16, 1, 0),
+                           new RELULayer(),
+                           new PoolingLayer({ 2, 2 }, 2),
+                           new ConvLayer(4, 4, 120, 1, 0),
+                           new RELULayer(),
+                           new FlattenLayer(),
+                           new DenseLayer(84),
+                           new RELULayer(),
+                           new DenseLayer(10),
+                           new SoftmaxLayer() },
+        new SDG(0.01), 10, { 1, 28, 28 });
+}
 
-    vector<pair<Mat, Mat>> train_data;
-    for (int i = 0; i < train_image.size(); i++) {
-        Mat mat(1, 10);
-        mat[0][train_label[i]] = 1;
-        train_data.push_back({ train_image[i], mat });
+// false when there is no data to train on
+bool train()
+{
+    // the IDX files are only parsed on the first run, later runs map the caches
+    for (string set : { "train", "t10k" }) {
+        if (DatasetCache("mnist-" + set).size() == 0) {
+            vector<ByteImage> images = read_mnist_bytes("./" + set + "-images.idx3-ubyte");
+            vector<int> labels = read_mnist_labels("./" + set + "-labels.idx1-ubyte");
+            if (images.empty() || images.size() != labels.size()) {
+                cout << "Error: can't read ./" << set << "-images.idx3-ubyte and ./" << set << "-labels.idx1-ubyte" << endl;
+                return false;
+            }
+            if (!writeDatasetCache("mnist-" + set, images, labels, 10)) {
+                cout << "Error: can't write the mnist-" << set << " cache" << endl;
+                return false;
+            }
+        }
+    }
+    DatasetCache train_set("mnist-train"), test_set("mnist-t10k");
+    if (train_set.size() == 0 || test_set.size() == 0) {
+        cout << "Error: can't map the mnist caches" << endl;
+        return false;
     }
 
     // Network network({ new FlattenLayer(28, 28), new DenseLayer(28 * 28, 16), new SigmoidLayer(), new DenseLayer(16, 16), new SigmoidLayer(), new DenseLayer(16, 10), new SigmoidLayer() }, new SDG(train_data, 0.5, 10));
-    Network network({ new ConvLayer(28, 28, 1, 5, 5, 6, 1, 0),
-                        new RELULayer(),
-                        new PoolingLayer(24, 24, 6, { 2, 2 }, 2),
-                        new ConvLayer(12, 12, 6, 5, 5, 16, 1, 0),
-                        new RELULayer(),
-                        new PoolingLayer(8, 8, 16, { 2, 2 }, 2),
-                        new ConvLayer(4, 4, 16, 4, 4, 120, 1, 0),
-                        new RELULayer(),
-                        new FlattenLayer(),
-                        new DenseLayer(120, 84),
-                        new RELULayer(),
-                        new DenseLayer(84, 10),
-                        new SoftmaxLayer() },
-        new SDG(0.01), 10);
+    unique_ptr<Network> network(lenet5());
     // Network network({ new ConvLayer(28, 28, 1, 3, 3, 1, 1, 0),
     //                     new PoolingLayer(26, 26, 1, { 2, 2 }, 2),
     //                     new ConvLayer(13, 13, 1, 3, 3, 1, 1, 0),
@@ -53,34 +72,42 @@ void train()
     //                     new DenseLayer(16, 10),
     //                     new SigmoidLayer() },
     //     new SDG(train_data, 0.5, 10));
-    network.init();
+    network->init();
+    if (perf::requested()) // CPPNN_PERF=1: per layer and kernel hardware counters, printed after the timings
+        perf::enable();
 
-    network.train(train_data);
+    CheckpointWriter writer("LeNet5.ckpt", 1000);
+    network->setCheckpointWriter(&writer);
+    network->setMetricsFile("LeNet5.prom"); // progress for a scraper, every 100 batches
 
-    ofstream fout("LeNet5.ckpt", ios::out | ios::trunc);
+    network->train(train_set.size(), [&](int i) { return train_set[i]; });
+    // Augmenter augmenter(read_mnist_bytes("./train-images.idx3-ubyte"), read_mnist_labels("./train-labels.idx1-ubyte"), 10, AugmentConfig(), 10);
+    // network.train(augmenter.source());
 
-    network.saveCheckpoint(fout);
+    writer.save(network->snapshot());
+    writer.flush();
 
     // ifstream fin("LeNet5.ckpt");
 
     // network.loadCheckpoint(fin);
 
     int correct = 0;
-    for (int i = 0; i < test_image.size(); i++) {
-        Mat result = network.forward(test_image[i]);
+    for (int i = 0; i < test_set.size(); i++) {
+        Mat result = network->forward(test_set[i].first);
         // cout << "result: " << max_element(result[0], result[0] + 10) - result[0] << "  ";
-        // cout << "answer: " << test_label[i] << endl;
-        if (max_element(result[0], result[0] + 10) - result[0] == test_label[i]) {
+        // cout << "answer: " << test_set.label(i) << endl;
+        if (max_element(result[0], result[0] + 10) - result[0] == test_set.label(i)) {
             correct++;
         }
     }
-    cout << "accuracy on test dataset: " << correct / (float)test_image.size() << endl;
+    cout << "accuracy on test dataset: " << correct / (float)test_set.size() << endl;
 
-    cout << "forward time: " << network.forwardTime / (float)CLOCKS_PER_SEC << endl;
-    cout << "backward time: " << network.backwardTime / (float)CLOCKS_PER_SEC << endl;
+    telemetry::writePrometheus(cout, telemetry::snapshot(*network->metrics));
     cout << "matrix multiplication time: " << mutil::multiplyTime / (float)CLOCKS_PER_SEC << endl;
     cout << "matrix multiplication count: " << mutil::multiplyCount << endl;
-    cout << "matrix construct time:" << mutil::constructTime << endl;
+    accounting::report(cout);
+    perf::report(cout);
+    return true;
 }
 
 void test()
@@ -90,32 +117,102 @@ void test()
     // debug::print(k);
 
     // vector<pair<Mat, Mat>> train_data;
-    Network network({ new ConvLayer(28, 28, 1, 5, 5, 6, 1, 0),
-                        new RELULayer(),
-                        new PoolingLayer(24, 24, 6, { 2, 2 }, 2),
-                        new ConvLayer(12, 12, 6, 5, 5, 16, 1, 0),
-                        new RELULayer(),
-                        new PoolingLayer(8, 8, 16, { 2, 2 }, 2),
-                        new ConvLayer(4, 4, 16, 4, 4, 120, 1, 0),
-                        new RELULayer(),
-                        new FlattenLayer(),
-                        new DenseLayer(120, 84),
-                        new RELULayer(),
-                        new DenseLayer(84, 10),
-                        new SoftmaxLayer() },
-        new SDG(0.01), 10);
+    unique_ptr<Network> network(lenet5());
 
     ifstream fin("LeNet5.ckpt");
 
-    network.loadCheckpoint(fin);
+    network->loadCheckpoint(fin);
 
-    Mat result = network.forward(k.to_Mat());
+    Mat result = network->forward(k.to_Mat());
     cout << max_element(result[0], result[0] + 10) - result[0] << endl;
 }
 
+// compiles LeNet5.ckpt into lenet5_bundle.h, include it and call lenet5::forward(in, out)
+void bundle()
+{
+    unique_ptr<Network> network(lenet5());
+
+    ifstream fin("LeNet5.ckpt");
+
+    network->loadCheckpoint(fin);
+    network->foldBatchNorm();
+
+    ofstream fout("lenet5_bundle.h");
+    if (!network->exportBundle(fout, "lenet5"))
+        cout << "network can't be exported" << endl;
+}
+
+// removes half the conv kernels of LeNet5.ckpt, fine-tunes for an epoch and compiles the
+// smaller network into lenet5_pruned_bundle.h
+void shrink()
+{
+    DatasetCache train_set("mnist-train"), test_set("mnist-t10k");
+    unique_ptr<Network> network(lenet5());
+
+    ifstream fin("LeNet5.ckpt");
+
+    network->loadCheckpoint(fin);
+
+    long before = network->multiplyAdds();
+    network->pruneChannels(0.5);
+    network->train(train_set.size(), [&](int i) { return train_set[i]; });
+    cout << "multiply-adds: " << before << " -> " << network->multiplyAdds() << endl;
+
+    int correct = 0;
+    for (int i = 0; i < test_set.size(); i++) {
+        Mat result = network->forward(test_set[i].first);
+        if (max_element(result[0], result[0] + 10) - result[0] == test_set.label(i))
+            correct++;
+    }
+    cout << "accuracy on test dataset: " << correct / (float)test_set.size() << endl;
+
+    ofstream fout("lenet5_pruned_bundle.h");
+    if (!network->exportBundle(fout, "lenet5_pruned"))
+        cout << "network can't be exported" << endl;
+}
+
+// bulk inference over every BMP in dir, resized to the network input
+void classify(string dir)
+{
+    unique_ptr<Network> network(lenet5());
+
+    ifstream fin("LeNet5.ckpt");
+
+    network->loadCheckpoint(fin);
+
+    ImageBatch batch = readBmpDirectory(dir, { 1, 28, 28 });
+    for (int i = 0; i < batch.size(); i++) {
+        Mat result = network->forward(batch.sample(i));
+        cout << batch.files[i] << ": " << max_element(result[0], result[0] + 10) - result[0] << endl;
+    }
+    for (auto& file : batch.failed) {
+        cout << "can't decode " << file << endl;
+    }
+}
+
+// daemon answering classification requests on a Unix domain socket, see serveStream for the protocol
+void serve(string path)
+{
+    BatchServer server([] {
+        Network* network = lenet5();
+        ifstream fin("LeNet5.ckpt");
+        network->loadCheckpoint(fin);
+        return network;
+    },
+        4, 16, 2000);
+    if (!serveUnixSocket(server, path))
+        cout << "can't listen on " << path << endl;
+    server.report(cout);
+}
+
 int main(void)
 {
     cin.tie(0);
-    train();
+    if (!train())
+        return 1;
     // test();
+    // bundle();
+    // shrink();
+    // classify("./images");
+    // serve("/tmp/lenet5.sock");
 }
\ No newline at end of file
@@ -57,6 +57,32 @@ vector<Mat> read_mnist_images(string full_path)
     return result;
 }
 
+// the raw bytes of every image, read in one go, e.g. for Augmenter
+vector<ByteImage> read_mnist_bytes(string full_path)
+{
+    vector<ByteImage> result;
+    ifstream file(full_path, ios::binary);
+    if (file.is_open()) {
+        int header[4];
+        file.read((char*)header, sizeof(header));
+        for (int& v : header) {
+            v = reverseInt(v);
+        }
+        if (header[0] != 2051)
+            throw runtime_error("Invalid MNIST image file!");
+        vector<uint8_t> pixels((size_t)header[1] * header[2] * header[3]);
+        file.read((char*)pixels.data(), pixels.size());
+        result.resize(header[1]);
+        for (int i = 0; i < header[1]; i++) {
+            result[i].channels = 1;
+            result[i].height = header[2];
+            result[i].width = header[3];
+            result[i].pixels.assign(pixels.begin() + (size_t)i * header[2] * header[3], pixels.begin() + (size_t)(i + 1) * header[2] * header[3]);
+        }
+    }
+    return result;
+}
+
 vector<int> read_mnist_labels(string full_path)
 {
     vector<int> result;
@@ -1,10 +1,18 @@
 #ifndef MUTIL_CPP
 #define MUTIL_CPP
 
+#include "accounting.cpp"
 #include "initializer.cpp"
+#include "perf.cpp"
+#include "simd.cpp"
+#include "threadpool.cpp"
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <cfloat>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <math.h>
@@ -17,10 +25,11 @@
 using namespace std;
 
 namespace mutil {
-static int copyCount = 0;
-static int constructTime = 0;
-static int multiplyTime = 0;
-static int multiplyCount = 0;
+// counters may be bumped from pool workers
+static atomic<int> multiplyTime { 0 };
+static atomic<int> multiplyCount { 0 };
+// roughly the flops one parallel_for task should get so scheduling stays negligible
+static const long parallel_work = 1 << 15;
 
 class Vec {
 
@@ -47,8 +56,11 @@ public:
     }
 };
 
+// Mat storage, counted by accounting under the allocating thread's tag
+typedef vector<float, accounting::Allocator<float>> Storage;
+
 class Mat {
-    vector<float> val;
+    Storage val;
 
 public:
     pair<int, int> size;
@@ -57,14 +69,12 @@ public:
         : val(m * n)
     {
         size = { m, n };
-        ++constructTime;
     }
 
     Mat(int m, int n, vector<float>& v)
-        : val(v)
+        : val(v.begin(), v.end())
     {
         size = { m, n };
-        ++constructTime;
     }
 
     auto operator[](int index)
@@ -147,16 +157,19 @@ public:
 
     Mat operator*(const Mat& other)
     {
+        perf::Scope scope("matmul");
         assert(size.second == other.size.first);
         auto start = clock();
         Mat res(size.first, other.size.second);
-        float r;
-        for (int i = 0; i < size.first; ++i)
-            for (int k = 0; k < size.second; ++k) {
-                r = (*this)[i][k];
-                for (int j = 0; j < other.size.second; ++j)
-                    res[i][j] += other[k][j] * r;
-            }
+        long row_work = (long)size.second * other.size.second;
+        pool::parallel_for(0, size.first, parallel_work / max(row_work, 1L), [&](long lo, long hi) {
+            for (int i = lo; i < hi; ++i)
+                for (int k = 0; k < size.second; ++k) {
+                    float r = (*this)[i][k];
+                    for (int j = 0; j < other.size.second; ++j)
+                        res[i][j] += other[k][j] * r;
+                }
+        });
         auto end = clock();
         multiplyTime += end - start;
         ++multiplyCount;
@@ -201,6 +214,44 @@ public:
             }
         }
     }
+
+    // raw binary form: rows, cols as int32 then the floats
+    void write(ostream& os)
+    {
+        int32_t dims[2] = { size.first, size.second };
+        os.write((char*)dims, sizeof(dims));
+        os.write((char*)val.data(), sizeof(float) * size.first * size.second);
+    }
+
+    // sets failbit instead of reading dimensions that can't be a Mat
+    void read(istream& is)
+    {
+        int32_t dims[2];
+        is.read((char*)dims, sizeof(dims));
+        if (!is || dims[0] < 0 || dims[1] < 0 || (dims[1] && dims[0] > INT32_MAX / dims[1])) {
+            is.setstate(ios::failbit);
+            return;
+        }
+        size = { dims[0], dims[1] };
+        val = Storage(size.first * size.second);
+        is.read((char*)val.data(), sizeof(float) * val.size());
+    }
+
+    // reinterprets the storage as m x n, growing it only when it is too small
+    Mat& reshape(int m, int n)
+    {
+        if (val.size() < m * n)
+            val.resize(m * n);
+        size = { m, n };
+        return *this;
+    }
+
+    // charges the storage to another accounting tag
+    void track(int tag)
+    {
+        if (val.data())
+            accounting::retag(val.data(), tag);
+    }
     friend ostream& operator<<(ostream& os, const Mat& mat);
     friend ofstream& operator<<(ofstream& os, const Mat& mat);
     friend istream& operator>>(istream& is, Mat& mat);
@@ -210,7 +261,7 @@ public:
 ostream& operator<<(ostream& os, const Mat& mat)
 {
     os << mat.size.first << ' ' << mat.size.second << ' ';
-    for (int i = 0; i < mat.val.size(); i++) {
+    for (int i = 0; i < mat.size.first * mat.size.second; i++) { // reshape may leave val longer
         os << mat.val[i] << ' ';
     }
     return os;
@@ -219,7 +270,7 @@ ostream& operator<<(ostream& os, const Mat& mat)
 ofstream& operator<<(ofstream& os, const Mat& mat)
 {
     os << mat.size.first << ' ' << mat.size.second << ' ';
-    for (int i = 0; i < mat.val.size(); i++) {
+    for (int i = 0; i < mat.size.first * mat.size.second; i++) {
         os << mat.val[i] << ' ';
     }
     return os;
@@ -228,7 +279,7 @@ ofstream& operator<<(ofstream& os, const Mat& mat)
 istream& operator>>(istream& is, Mat& mat)
 {
     is >> mat.size.first >> mat.size.second;
-    mat.val = vector<float>(mat.size.first * mat.size.second);
+    mat.val = Storage(mat.size.first * mat.size.second);
     for (int i = 0; i < mat.val.size(); i++) {
         is >> mat.val[i];
     }
@@ -238,7 +289,7 @@ istream& operator>>(istream& is, Mat& mat)
 ifstream& operator>>(ifstream& is, Mat& mat)
 {
     is >> mat.size.first >> mat.size.second;
-    mat.val = vector<float>(mat.size.first * mat.size.second);
+    mat.val = Storage(mat.size.first * mat.size.second);
     for (int i = 0; i < mat.val.size(); i++) {
         is >> mat.val[i];
     }
@@ -246,11 +297,11 @@ ifstream& operator>>(ifstream& is, Mat& mat)
 }
 
 class Kernel {
-    vector<float>::iterator val;
+    Storage::iterator val;
 
 public:
     pair<int, int> size;
-    Kernel(int m, int n, vector<float>::iterator val)
+    Kernel(int m, int n, Storage::iterator val)
         : val(val)
     {
         size = { m, n };
@@ -295,11 +346,11 @@ public:
 
 class Tensor {
     vector<int> dimension;
-    vector<float>::iterator val;
+    Storage::iterator val;
     int size = 1;
 
 public:
-    Tensor(vector<int> dimension, vector<float>::iterator val)
+    Tensor(vector<int> dimension, Storage::iterator val)
         : dimension(dimension)
         , val(val)
     {
@@ -325,67 +376,258 @@ public:
     }
 };
 
-Mat& sigmoid(Mat& in)
+// compressed sparse row storage for pruned weights, values are kept in a 1 x nnz Mat
+// so that optimizers can update them like any other parameter
+class SparseMat {
+
+public:
+    pair<int, int> size;
+    vector<int> row_ptr, col;
+    Mat val;
+    SparseMat() { }
+
+    // keeps the entries of dense whose magnitude is above threshold
+    SparseMat(Mat& dense, float threshold)
+        : row_ptr(1, 0)
+    {
+        size = dense.size;
+        vector<float> v;
+        for (int i = 0; i < size.first; i++) {
+            for (int j = 0; j < size.second; j++) {
+                if (fabs(dense[i][j]) > threshold) {
+                    col.push_back(j);
+                    v.push_back(dense[i][j]);
+                }
+            }
+            row_ptr.push_back(col.size());
+        }
+        val = Mat(1, v.size(), v);
+    }
+
+    int nnz()
+    {
+        return col.size();
+    }
+
+    // binary form of the sparsity pattern, the values travel as an ordinary Mat
+    void writePattern(ostream& os)
+    {
+        int32_t head[3] = { size.first, size.second, (int32_t)col.size() };
+        os.write((char*)head, sizeof(head));
+        os.write((char*)row_ptr.data(), sizeof(int) * row_ptr.size());
+        os.write((char*)col.data(), sizeof(int) * col.size());
+    }
+
+    void readPattern(istream& is)
+    {
+        int32_t head[3];
+        is.read((char*)head, sizeof(head));
+        if (!is || head[0] < 0 || head[0] == INT32_MAX || head[1] < 0 || head[2] < 0) {
+            is.setstate(ios::failbit);
+            return;
+        }
+        size = { head[0], head[1] };
+        row_ptr = vector<int>(size.first + 1);
+        col = vector<int>(head[2]);
+        is.read((char*)row_ptr.data(), sizeof(int) * row_ptr.size());
+        is.read((char*)col.data(), sizeof(int) * col.size());
+        val = Mat(1, head[2]);
+    }
+
+    Mat to_Mat()
+    {
+        Mat res(size.first, size.second);
+        for (int i = 0; i < size.first; i++) {
+            for (int p = row_ptr[i]; p < row_ptr[i + 1]; p++) {
+                res[i][col[p]] = val[0][p];
+            }
+        }
+        return res;
+    }
+
+    friend ostream& operator<<(ostream& os, const SparseMat& mat);
+    friend istream& operator>>(istream& is, SparseMat& mat);
+};
+
+ostream& operator<<(ostream& os, const SparseMat& mat)
+{
+    os << "csr " << mat.size.first << ' ' << mat.size.second << ' ' << mat.col.size() << ' ';
+    for (int i = 0; i < mat.row_ptr.size(); i++) {
+        os << mat.row_ptr[i] << ' ';
+    }
+    for (int i = 0; i < mat.col.size(); i++) {
+        os << mat.col[i] << ' ';
+    }
+    return os << mat.val;
+}
+
+istream& operator>>(istream& is, SparseMat& mat)
+{
+    string tag;
+    int nnz;
+    is >> tag >> mat.size.first >> mat.size.second >> nnz;
+    mat.row_ptr = vector<int>(mat.size.first + 1);
+    mat.col = vector<int>(nnz);
+    for (int i = 0; i < mat.row_ptr.size(); i++) {
+        is >> mat.row_ptr[i];
+    }
+    for (int i = 0; i < nnz; i++) {
+        is >> mat.col[i];
+    }
+    return is >> mat.val;
+}
+
+// magnitude below which a fraction sparsity of the entries of in falls
+float magnitude_threshold(Mat& in, float sparsity)
 {
+    vector<float> mag;
     for (int i = 0; i < in.size.first; i++) {
         for (int j = 0; j < in.size.second; j++) {
-            in[i][j] = 1 / (1 + exp(-in[i][j]));
+            mag.push_back(fabs(in[i][j]));
         }
     }
+    int k = sparsity * mag.size();
+    if (k <= 0)
+        return -1;
+    nth_element(mag.begin(), mag.begin() + k - 1, mag.end());
+    return mag[k - 1];
+}
+
+// applies f to every element of in, split across the pool for large matrices
+template <class F>
+Mat& elementwise(Mat& in, F f)
+{
+    long n = (long)in.size.first * in.size.second;
+    if (n == 0)
+        return in;
+    auto val = in[0];
+    pool::parallel_for(0, n, parallel_work / 16, [&](long lo, long hi) {
+        for (long i = lo; i < hi; i++) {
+            val[i] = f(val[i]);
+        }
+    });
     return in;
 }
 
+// calls f(p, n) on contiguous spans covering in, for the simd array kernels
+template <class F>
+Mat& spanwise(Mat& in, F f)
+{
+    long n = (long)in.size.first * in.size.second;
+    if (n == 0)
+        return in;
+    float* val = &*in[0];
+    pool::parallel_for(0, n, parallel_work / 4, [&](long lo, long hi) {
+        f(val + lo, hi - lo);
+    });
+    return in;
+}
+
+Mat& sigmoid(Mat& in)
+{
+    perf::Scope scope("sigmoid");
+    return spanwise(in, [](float* p, long n) { simd::sigmoid(p, p, n); });
+}
+
 Mat& sigmoid_prime(Mat& in)
 {
-    for (int i = 0; i < in.size.first; i++) {
-        for (int j = 0; j < in.size.second; j++) {
-            float s = 1 / (1 + exp(-in[i][j]));
-            in[i][j] = s * (1 - s);
+    perf::Scope scope("sigmoid_prime");
+    return spanwise(in, [](float* p, long n) {
+        simd::sigmoid(p, p, n);
+        for (long i = 0; i < n; i++) {
+            p[i] = p[i] * (1 - p[i]);
         }
-    }
-    return in;
+    });
 }
 
 Mat& relu(Mat& in)
 {
-    for (int i = 0; i < in.size.first; i++) {
-        for (int j = 0; j < in.size.second; j++) {
-            in[i][j] = max(0.0f, in[i][j]);
-        }
-    }
-    return in;
+    perf::Scope scope("relu");
+    return elementwise(in, [](float v) { return max(0.0f, v); });
 }
 
 Mat& relu_prime(Mat& in)
 {
-    for (int i = 0; i < in.size.first; i++) {
-        for (int j = 0; j < in.size.second; j++) {
-            in[i][j] = in[i][j] > 0 ? 1 : 0;
-        }
-    }
-    return in;
+    perf::Scope scope("relu_prime");
+    return elementwise(in, [](float v) { return v > 0 ? 1.0f : 0.0f; });
 }
 
 Mat& tanh(Mat& in)
 {
-    for (int i = 0; i < in.size.first; i++) {
-        for (int j = 0; j < in.size.second; j++) {
-            in[i][j] = ::tanh(in[i][j]);
-        }
-    }
-    return in;
+    perf::Scope scope("tanh");
+    return spanwise(in, [](float* p, long n) { simd::tanh(p, p, n); });
 }
 
 Mat& tanh_prime(Mat& in)
 {
-    for (int i = 0; i < in.size.first; i++) {
-        for (int j = 0; j < in.size.second; j++) {
-            in[i][j] = 1 - in[i][j] * in[i][j];
+    perf::Scope scope("tanh_prime");
+    return elementwise(in, [](float v) { return 1 - v * v; });
+}
+
+// a[i] = f(a[i], b[i]), e.g. a gradient times the derivative taken from a cached output
+template <class F>
+Mat& combine(Mat& a, Mat& b, F f)
+{
+    assert(a.size == b.size);
+    long n = (long)a.size.first * a.size.second;
+    if (n == 0)
+        return a;
+    auto x = a[0], y = b[0];
+    pool::parallel_for(0, n, parallel_work / 4, [&](long lo, long hi) {
+        for (long i = lo; i < hi; i++) {
+            x[i] = f(x[i], y[i]);
         }
-    }
+    });
+    return a;
+}
+
+// one bit per element, set where relu let the input through
+typedef vector<uint64_t, accounting::Allocator<uint64_t>> Mask;
+
+// relu in place, recording in mask which elements were positive
+Mat& relu(Mat& in, Mask& mask)
+{
+    perf::Scope scope("relu");
+    long n = (long)in.size.first * in.size.second;
+    mask.assign((n + 63) / 64, 0);
+    if (n == 0)
+        return in;
+    auto val = in[0];
+    // whole words per task, so no two threads write the same one
+    pool::parallel_for(0, mask.size(), parallel_work / 256, [&](long lo, long hi) {
+        for (long w = lo; w < hi; w++) {
+            uint64_t bits = 0;
+            for (long i = w * 64, b = 0; i < min(n, (w + 1) * 64); i++, b++) {
+                bool positive = val[i] > 0;
+                bits |= (uint64_t)positive << b;
+                val[i] = positive ? val[i] : 0;
+            }
+            mask[w] = bits;
+        }
+    });
     return in;
 }
 
+// zeroes the gradient where relu blocked the input
+Mat& relu_prime(Mat& delta, Mask& mask)
+{
+    perf::Scope scope("relu_prime");
+    long n = (long)delta.size.first * delta.size.second;
+    assert(mask.size() == (n + 63) / 64);
+    if (n == 0)
+        return delta;
+    auto val = delta[0];
+    pool::parallel_for(0, mask.size(), parallel_work / 256, [&](long lo, long hi) {
+        for (long w = lo; w < hi; w++) {
+            uint64_t bits = mask[w];
+            for (long i = w * 64, b = 0; i < min(n, (w + 1) * 64); i++, b++) {
+                val[i] = bits >> b & 1 ? val[i] : 0;
+            }
+        }
+    });
+    return delta;
+}
+
 pair<int, int> compute_output_size(int in_height, int in_width, int kernel_height, int kernel_width, int stride, int padding)
 {
     int out_height = (in_height - kernel_height + 2 * padding) / stride + 1;
@@ -520,25 +762,169 @@ void mean_pooling_prime(Kernel& delta, Kernel& out, pair<int, int>& size, int st
     }
 }
 
-void softmax(Mat& in)
+// activation layouts: NCHW is channel x (height * width), one row per channel, and NHWC is
+// (height * width) x channel, one row per pixel with the channels contiguous
+enum Layout {
+    NCHW,
+    NHWC
+};
+
+// out becomes in, given as channels x area in the from layout, in the to layout
+void transform_layout(Mat& in, int channels, int area, Layout from, Layout to, Mat& out)
 {
-    for (int i = 0; i < in.size.first; i++) {
-        float sum = 0;
-        float max = FLT_MIN;
-        for (int j = 0; j < in.size.second; j++) {
-            if (in[i][j] > max) {
-                max = in[i][j];
+    perf::Scope scope("transform_layout");
+    auto src = in[0];
+    if (from == to) {
+        out = Mat(from == NCHW ? channels : area, from == NCHW ? area : channels);
+        copy(src, src + channels * area, out[0]);
+        return;
+    }
+    if (to == NHWC) {
+        out = Mat(area, channels);
+        for (int c = 0; c < channels; c++) {
+            for (int p = 0; p < area; p++) {
+                out[p][c] = src[c * area + p];
             }
         }
-        for (int j = 0; j < in.size.second; j++) {
-            sum += exp(in[i][j] - max);
+    } else {
+        out = Mat(channels, area);
+        for (int p = 0; p < area; p++) {
+            for (int c = 0; c < channels; c++) {
+                out[c][p] = src[p * channels + c];
+            }
         }
-        for (int j = 0; j < in.size.second; j++) {
-            in[i][j] = exp(in[i][j] - max) / sum;
+    }
+}
+
+// NHWC pooling, in is (height * width) x channels and out (out_h * out_w) x channels.
+// the inner loops run over contiguous channels
+void max_pooling_nhwc(Mat& in, int channels, int height, int width, pair<int, int>& size, int stride, Mat& out)
+{
+    perf::Scope scope("max_pooling_nhwc");
+    int out_w = (width - size.second) / stride + 1;
+    pool::parallel_for(0, out.size.first, parallel_work / max(channels * size.first * size.second, 1), [&](long lo, long hi) {
+        for (int p = lo; p < hi; p++) {
+            auto res = out[p];
+            fill(res, res + channels, FLT_MIN);
+            for (int k = 0; k < size.first; k++) {
+                for (int l = 0; l < size.second; l++) {
+                    int x = p / out_w * stride + k;
+                    int y = p % out_w * stride + l;
+                    if (x >= height || y >= width)
+                        continue;
+                    auto src = in[x * width + y];
+                    for (int c = 0; c < channels; c++) {
+                        res[c] = max(res[c], src[c]);
+                    }
+                }
+            }
+        }
+    });
+}
+
+void mean_pooling_nhwc(Mat& in, int channels, int height, int width, pair<int, int>& size, int stride, Mat& out)
+{
+    perf::Scope scope("mean_pooling_nhwc");
+    int out_w = (width - size.second) / stride + 1;
+    float area = size.first * size.second;
+    pool::parallel_for(0, out.size.first, parallel_work / max(channels * size.first * size.second, 1), [&](long lo, long hi) {
+        for (int p = lo; p < hi; p++) {
+            auto res = out[p];
+            fill(res, res + channels, 0.0f);
+            for (int k = 0; k < size.first; k++) {
+                for (int l = 0; l < size.second; l++) {
+                    int x = p / out_w * stride + k;
+                    int y = p % out_w * stride + l;
+                    if (x >= height || y >= width)
+                        continue;
+                    auto src = in[x * width + y];
+                    for (int c = 0; c < channels; c++) {
+                        res[c] += src[c];
+                    }
+                }
+            }
+            for (int c = 0; c < channels; c++) {
+                res[c] /= area;
+            }
+        }
+    });
+}
+
+// same semantics as max_pooling_prime: the window maximum receives the gradient
+void max_pooling_nhwc_prime(Mat& img, Mat& delta, int channels, int height, int width, pair<int, int>& size, int stride, Mat& out)
+{
+    perf::Scope scope("max_pooling_nhwc_prime");
+    int out_w = (width - size.second) / stride + 1;
+    vector<float> best(channels);
+    vector<int> arg(channels);
+    for (int p = 0; p < delta.size.first; p++) {
+        fill(best.begin(), best.end(), FLT_MIN);
+        fill(arg.begin(), arg.end(), 0);
+        for (int k = 0; k < size.first; k++) {
+            for (int l = 0; l < size.second; l++) {
+                int x = p / out_w * stride + k;
+                int y = p % out_w * stride + l;
+                if (x >= height || y >= width)
+                    continue;
+                auto src = img[x * width + y];
+                for (int c = 0; c < channels; c++) {
+                    if (src[c] > best[c]) {
+                        best[c] = src[c];
+                        arg[c] = x * width + y;
+                    }
+                }
+            }
+        }
+        for (int c = 0; c < channels; c++) {
+            out[arg[c]][c] = delta[p][c];
         }
     }
 }
 
+void mean_pooling_nhwc_prime(Mat& delta, int channels, int height, int width, pair<int, int>& size, int stride, Mat& out)
+{
+    perf::Scope scope("mean_pooling_nhwc_prime");
+    int out_w = (width - size.second) / stride + 1;
+    float area = size.first * size.second;
+    for (int p = 0; p < delta.size.first; p++) {
+        auto d = delta[p];
+        for (int k = 0; k < size.first; k++) {
+            for (int l = 0; l < size.second; l++) {
+                int x = p / out_w * stride + k;
+                int y = p % out_w * stride + l;
+                if (x >= height || y >= width)
+                    continue;
+                auto dst = out[x * width + y];
+                for (int c = 0; c < channels; c++) {
+                    dst[c] = d[c] / area;
+                }
+            }
+        }
+    }
+}
+
+void softmax(Mat& in)
+{
+    perf::Scope scope("softmax");
+    pool::parallel_for(0, in.size.first, parallel_work / 16 / max(in.size.second, 1), [&](long lo, long hi) {
+        for (int i = lo; i < hi; i++) {
+            float* row = &*in[i];
+            int n = in.size.second;
+            float max = *max_element(row, row + n), sum = 0;
+            for (int j = 0; j < n; j++) {
+                row[j] -= max;
+            }
+            simd::exp(row, row, n);
+            for (int j = 0; j < n; j++) {
+                sum += row[j];
+            }
+            for (int j = 0; j < n; j++) {
+                row[j] /= sum;
+            }
+        }
+    });
+}
+
 inline float im2col_get_pixel(Mat& in, int height, int width, int channels, int row, int col, int channel, int pad)
 {
     row -= pad;
@@ -551,25 +937,28 @@ inline float im2col_get_pixel(Mat& in, int height, int width, int channels, int
 
 void im2col(Mat& in, int channels, int height, int width, pair<int, int> ksize, int stride, int pad, Mat& out)
 {
-    int c, h, w;
+    perf::Scope scope("im2col");
     int height_col = (height + 2 * pad - ksize.first) / stride + 1;
     int width_col = (width + 2 * pad - ksize.second) / stride + 1;
 
     int channels_col = channels * ksize.first * ksize.second;
-    for (c = 0; c < channels_col; ++c) {
-        int w_offset = c % ksize.second;
-        int h_offset = (c / ksize.second) % ksize.first;
-        int c_im = c / ksize.first / ksize.second;
-        for (h = 0; h < height_col; ++h) {
-            for (w = 0; w < width_col; ++w) {
-                int im_row = h_offset + h * stride;
-                int im_col = w_offset + w * stride;
-                int col_index = (c * height_col + h) * width_col + w;
-                assert(col_index < out.size.first * out.size.second);
-                out[0][col_index] = im2col_get_pixel(in, height, width, channels, im_row, im_col, c_im, pad);
+    // every row of the column buffer is written by one task
+    pool::parallel_for(0, channels_col, parallel_work / max(height_col * width_col, 1), [&](long lo, long hi) {
+        for (int c = lo; c < hi; ++c) {
+            int w_offset = c % ksize.second;
+            int h_offset = (c / ksize.second) % ksize.first;
+            int c_im = c / ksize.first / ksize.second;
+            for (int h = 0; h < height_col; ++h) {
+                for (int w = 0; w < width_col; ++w) {
+                    int im_row = h_offset + h * stride;
+                    int im_col = w_offset + w * stride;
+                    int col_index = (c * height_col + h) * width_col + w;
+                    assert(col_index < out.size.first * out.size.second);
+                    out[0][col_index] = im2col_get_pixel(in, height, width, channels, im_row, im_col, c_im, pad);
+                }
             }
         }
-    }
+    });
 }
 
 void col2im_add_pixel(Mat& im, int height, int width, int channels, int row, int col, int channel, int pad, float val)
@@ -584,45 +973,547 @@ void col2im_add_pixel(Mat& im, int height, int width, int channels, int row, int
 
 void col2im(Mat& in, int channels, int height, int width, pair<int, int> ksize, int stride, int pad, Mat& out)
 {
-    int c, h, w;
+    perf::Scope scope("col2im");
     int height_col = (height + 2 * pad - ksize.first) / stride + 1;
     int width_col = (width + 2 * pad - ksize.second) / stride + 1;
 
-    int channels_col = channels * ksize.first * ksize.second;
-    for (c = 0; c < channels_col; ++c) {
-        int w_offset = c % ksize.second;
-        int h_offset = (c / ksize.second) % ksize.first;
-        int c_im = c / ksize.first / ksize.second;
-        for (h = 0; h < height_col; ++h) {
-            for (w = 0; w < width_col; ++w) {
-                int im_row = h_offset + h * stride;
-                int im_col = w_offset + w * stride;
-                int col_index = (c * height_col + h) * width_col + w;
-                assert(col_index < in.size.first * in.size.second);
-                float val = in[0][col_index];
-                col2im_add_pixel(out, height, width, channels, im_row, im_col, c_im, pad, val);
+    int kernel_area = ksize.first * ksize.second;
+    // rows of one image channel overlap in the image, so tasks own whole channels
+    pool::parallel_for(0, channels, parallel_work / max(kernel_area * height_col * width_col, 1), [&](long lo, long hi) {
+        for (int c = lo * kernel_area; c < hi * kernel_area; ++c) {
+            int w_offset = c % ksize.second;
+            int h_offset = (c / ksize.second) % ksize.first;
+            int c_im = c / ksize.first / ksize.second;
+            for (int h = 0; h < height_col; ++h) {
+                for (int w = 0; w < width_col; ++w) {
+                    int im_row = h_offset + h * stride;
+                    int im_col = w_offset + w * stride;
+                    int col_index = (c * height_col + h) * width_col + w;
+                    assert(col_index < in.size.first * in.size.second);
+                    float val = in[0][col_index];
+                    col2im_add_pixel(out, height, width, channels, im_row, im_col, c_im, pad, val);
+                }
             }
         }
+    });
+}
+
+// implicit GEMM: the convolution as w' * col with w'[j][c * kk + t] = w[c * kernel_count + j][t],
+// where the im2col matrix col only ever exists as tiles of conv_tile columns packed on the fly.
+// the kernels take the tiles from a scratch Mat with a row per pool participant, so no task allocates
+static const int conv_tile = 64;
+
+// rows [r_begin, r_end) and columns [p_begin, p_end) of the im2col matrix of in, row-major into tile
+void im2col_tile(Mat& in, int height, int width, pair<int, int> ksize, int stride, int pad, int r_begin, int r_end, int p_begin, int p_end, float* tile)
+{
+    int width_col = (width + 2 * pad - ksize.second) / stride + 1;
+    for (int r = r_begin; r < r_end; r++) {
+        int w_offset = r % ksize.second;
+        int h_offset = (r / ksize.second) % ksize.first;
+        auto img = in[r / ksize.first / ksize.second];
+        for (int p = p_begin; p < p_end; p++) {
+            int row = p / width_col * stride + h_offset - pad;
+            int col = p % width_col * stride + w_offset - pad;
+            *tile++ = row >= 0 && col >= 0 && row < height && col < width ? img[row * width + col] : 0;
+        }
+    }
+}
+
+// adds a tile laid out as in im2col_tile back onto the image
+void col2im_tile(float* tile, int height, int width, pair<int, int> ksize, int stride, int pad, int r_begin, int r_end, int p_begin, int p_end, Mat& out)
+{
+    int width_col = (width + 2 * pad - ksize.second) / stride + 1;
+    for (int r = r_begin; r < r_end; r++) {
+        int w_offset = r % ksize.second;
+        int h_offset = (r / ksize.second) % ksize.first;
+        auto img = out[r / ksize.first / ksize.second];
+        for (int p = p_begin; p < p_end; p++, tile++) {
+            int row = p / width_col * stride + h_offset - pad;
+            int col = p % width_col * stride + w_offset - pad;
+            if (row >= 0 && col >= 0 && row < height && col < width)
+                img[row * width + col] += *tile;
+        }
     }
 }
 
+// out (kernel_count x out_h * out_w) += w' * col, tasks own blocks of output columns
+void implicit_conv(Mat& in, int channels, int height, int width, pair<int, int> ksize, int stride, int pad, Mat& w, int kernel_count, Mat& out, Mat& tiles)
+{
+    perf::Scope scope("implicit_conv");
+    int kk = ksize.first * ksize.second, rows = channels * kk;
+    int out_len = out.size.second;
+    int blocks = (out_len + conv_tile - 1) / conv_tile;
+    long block_work = (long)rows * conv_tile * kernel_count;
+    pool::parallel_for(0, blocks, parallel_work / block_work, [&](long lo, long hi) {
+        float* tile = &*tiles[pool::participant()];
+        for (int block = lo; block < hi; block++) {
+            int p_begin = block * conv_tile, p_end = min(out_len, p_begin + conv_tile), n = p_end - p_begin;
+            im2col_tile(in, height, width, ksize, stride, pad, 0, rows, p_begin, p_end, tile);
+            for (int j = 0; j < kernel_count; j++) {
+                auto res = out[j] + p_begin;
+                for (int c = 0; c < channels; c++) {
+                    auto kernel = w[c * kernel_count + j];
+                    for (int t = 0; t < kk; t++) {
+                        float r = kernel[t];
+                        float* src = tile + (c * kk + t) * n;
+                        for (int q = 0; q < n; q++)
+                            res[q] += r * src[q];
+                    }
+                }
+            }
+        }
+    });
+}
+
+// delta_w (channels * kernel_count x kk) += delta * col^T, tasks own input channels
+void implicit_conv_prime_w(Mat& in, int channels, int height, int width, pair<int, int> ksize, int stride, int pad, Mat& delta, int kernel_count, Mat& delta_w, Mat& tiles)
+{
+    perf::Scope scope("implicit_conv_prime_w");
+    int kk = ksize.first * ksize.second;
+    int out_len = delta.size.second;
+    long channel_work = (long)kk * out_len * kernel_count;
+    pool::parallel_for(0, channels, parallel_work / channel_work, [&](long lo, long hi) {
+        float* tile = &*tiles[pool::participant()];
+        for (int c = lo; c < hi; c++) {
+            for (int p_begin = 0; p_begin < out_len; p_begin += conv_tile) {
+                int p_end = min(out_len, p_begin + conv_tile), n = p_end - p_begin;
+                im2col_tile(in, height, width, ksize, stride, pad, c * kk, (c + 1) * kk, p_begin, p_end, tile);
+                for (int j = 0; j < kernel_count; j++) {
+                    auto d = delta[j] + p_begin;
+                    auto dw = delta_w[c * kernel_count + j];
+                    for (int t = 0; t < kk; t++) {
+                        float* src = tile + t * n;
+                        float r = 0;
+                        for (int q = 0; q < n; q++)
+                            r += d[q] * src[q];
+                        dw[t] += r;
+                    }
+                }
+            }
+        }
+    });
+}
+
+// out (channels x height * width) += col2im(w'^T * delta), tasks own input channels
+void implicit_conv_prime_in(Mat& delta, Mat& w, int kernel_count, int channels, int height, int width, pair<int, int> ksize, int stride, int pad, Mat& out, Mat& tiles)
+{
+    perf::Scope scope("implicit_conv_prime_in");
+    int kk = ksize.first * ksize.second;
+    int out_len = delta.size.second;
+    long channel_work = (long)kk * out_len * kernel_count;
+    pool::parallel_for(0, channels, parallel_work / channel_work, [&](long lo, long hi) {
+        float* tile = &*tiles[pool::participant()];
+        for (int c = lo; c < hi; c++) {
+            for (int p_begin = 0; p_begin < out_len; p_begin += conv_tile) {
+                int p_end = min(out_len, p_begin + conv_tile), n = p_end - p_begin;
+                fill(tile, tile + kk * n, 0);
+                for (int j = 0; j < kernel_count; j++) {
+                    auto d = delta[j] + p_begin;
+                    auto kernel = w[c * kernel_count + j];
+                    for (int t = 0; t < kk; t++) {
+                        float r = kernel[t];
+                        float* dst = tile + t * n;
+                        for (int q = 0; q < n; q++)
+                            dst[q] += r * d[q];
+                    }
+                }
+                col2im_tile(tile, height, width, ksize, stride, pad, c * kk, (c + 1) * kk, p_begin, p_end, out);
+            }
+        }
+    });
+}
+
 void multiply(Kernel& a, Kernel& b, Kernel& res)
 {
+    perf::Scope scope("multiply");
     assert(a.size.second == b.size.first);
     assert(res.size.first == a.size.first && res.size.second == b.size.second);
     auto start = clock();
-    float r;
-    for (int i = 0; i < a.size.first; ++i)
-        for (int k = 0; k < a.size.second; ++k) {
-            r = a[i][k];
-            for (int j = 0; j < b.size.second; ++j)
-                res[i][j] += b[k][j] * r;
+    long row_work = (long)a.size.second * b.size.second;
+    if (a.size.first > 1) {
+        pool::parallel_for(0, a.size.first, parallel_work / max(row_work, 1L), [&](long lo, long hi) {
+            for (int i = lo; i < hi; ++i)
+                for (int k = 0; k < a.size.second; ++k) {
+                    float r = a[i][k];
+                    for (int j = 0; j < b.size.second; ++j)
+                        res[i][j] += b[k][j] * r;
+                }
+        });
+    } else if (a.size.first == 1) {
+        // a single row, split the columns instead
+        pool::parallel_for(0, b.size.second, parallel_work / max(a.size.second, 1), [&](long lo, long hi) {
+            for (int k = 0; k < a.size.second; ++k) {
+                float r = a[0][k];
+                for (int j = lo; j < hi; ++j)
+                    res[0][j] += b[k][j] * r;
+            }
+        });
+    }
+    auto end = clock();
+    multiplyTime += end - start;
+    ++multiplyCount;
+}
+
+// NHWC convolution, in is (height * width) x channels, out (out_h * out_w) x kernel_count is added to.
+// w_hwc is (kh * kw * channels) x kernel_count with row t * channels + c = w[c * kernel_count + k][t],
+// so the innermost loop runs over contiguous output channels
+void conv_nhwc(Mat& in, int channels, int height, int width, pair<int, int> ksize, int stride, int pad, Mat& w_hwc, int kernel_count, Mat& out)
+{
+    perf::Scope scope("conv_nhwc");
+    int out_w = (width + 2 * pad - ksize.second) / stride + 1;
+    long pixel_work = (long)ksize.first * ksize.second * channels * kernel_count;
+    pool::parallel_for(0, out.size.first, parallel_work / pixel_work, [&](long lo, long hi) {
+        for (int p = lo; p < hi; p++) {
+            auto res = out[p];
+            for (int t = 0; t < ksize.first * ksize.second; t++) {
+                int x = p / out_w * stride + t / ksize.second - pad;
+                int y = p % out_w * stride + t % ksize.second - pad;
+                if (x < 0 || y < 0 || x >= height || y >= width)
+                    continue;
+                auto src = in[x * width + y];
+                for (int c = 0; c < channels; c++) {
+                    float r = src[c];
+                    auto kernel = w_hwc[t * channels + c];
+                    for (int k = 0; k < kernel_count; k++)
+                        res[k] += r * kernel[k];
+                }
+            }
         }
+    });
+}
+
+// gradients of conv_nhwc: delta_w_hwc (laid out as w_hwc) and out (as in) are added to
+void conv_nhwc_prime(Mat& in, int channels, int height, int width, pair<int, int> ksize, int stride, int pad, Mat& w_hwc, Mat& delta, int kernel_count, Mat& delta_w_hwc, Mat& out)
+{
+    perf::Scope scope("conv_nhwc_prime");
+    int out_w = (width + 2 * pad - ksize.second) / stride + 1;
+    int kk = ksize.first * ksize.second;
+    long tap_work = (long)delta.size.first * channels * kernel_count;
+    // weight gradient, tasks own kernel taps
+    pool::parallel_for(0, kk, parallel_work / tap_work, [&](long lo, long hi) {
+        for (int t = lo; t < hi; t++) {
+            for (int p = 0; p < delta.size.first; p++) {
+                int x = p / out_w * stride + t / ksize.second - pad;
+                int y = p % out_w * stride + t % ksize.second - pad;
+                if (x < 0 || y < 0 || x >= height || y >= width)
+                    continue;
+                auto src = in[x * width + y];
+                auto d = delta[p];
+                for (int c = 0; c < channels; c++) {
+                    float r = src[c];
+                    auto dw = delta_w_hwc[t * channels + c];
+                    for (int k = 0; k < kernel_count; k++)
+                        dw[k] += r * d[k];
+                }
+            }
+        }
+    });
+    // input gradient, tasks own input channels since windows overlap in the image
+    pool::parallel_for(0, channels, parallel_work / max(tap_work * kk / channels, 1L), [&](long lo, long hi) {
+        for (int p = 0; p < delta.size.first; p++) {
+            auto d = delta[p];
+            for (int t = 0; t < kk; t++) {
+                int x = p / out_w * stride + t / ksize.second - pad;
+                int y = p % out_w * stride + t % ksize.second - pad;
+                if (x < 0 || y < 0 || x >= height || y >= width)
+                    continue;
+                auto dst = out[x * width + y];
+                for (int c = lo; c < hi; c++) {
+                    auto kernel = w_hwc[t * channels + c];
+                    float r = 0;
+                    for (int k = 0; k < kernel_count; k++)
+                        r += d[k] * kernel[k];
+                    dst[c] += r;
+                }
+            }
+        }
+    });
+}
+
+// res += a * b^T, every entry is a dot product of two rows
+void multiply_transpose(Kernel& a, Kernel& b, Kernel& res)
+{
+    perf::Scope scope("multiply_transpose");
+    assert(a.size.second == b.size.second);
+    assert(res.size.first == a.size.first && res.size.second == b.size.first);
+    auto start = clock();
+    int n = res.size.second;
+    pool::parallel_for(0, (long)res.size.first * n, parallel_work / max(a.size.second, 1), [&](long lo, long hi) {
+        for (long e = lo; e < hi; e++) {
+            auto row = a[e / n], other = b[e % n];
+            float r = 0;
+            for (int k = 0; k < a.size.second; ++k)
+                r += row[k] * other[k];
+            res[e / n][e % n] += r;
+        }
+    });
+    auto end = clock();
+    multiplyTime += end - start;
+    ++multiplyCount;
+}
+
+// res += a^T * b
+void transpose_multiply(Kernel& a, Kernel& b, Kernel& res)
+{
+    perf::Scope scope("transpose_multiply");
+    assert(a.size.first == b.size.first);
+    assert(res.size.first == a.size.second && res.size.second == b.size.second);
+    auto start = clock();
+    long row_work = (long)a.size.first * b.size.second;
+    pool::parallel_for(0, res.size.first, parallel_work / max(row_work, 1L), [&](long lo, long hi) {
+        for (int i = lo; i < hi; ++i)
+            for (int k = 0; k < a.size.first; ++k) {
+                float r = a[k][i];
+                for (int j = 0; j < b.size.second; ++j)
+                    res[i][j] += b[k][j] * r;
+            }
+    });
     auto end = clock();
     multiplyTime += end - start;
     ++multiplyCount;
 }
 
+// res += a * b
+void sparse_multiply(Kernel& a, SparseMat& b, Kernel& res)
+{
+    perf::Scope scope("sparse_multiply");
+    assert(a.size.second == b.size.first);
+    assert(res.size.first == a.size.first && res.size.second == b.size.second);
+    for (int i = 0; i < a.size.first; i++) {
+        for (int k = 0; k < b.size.first; k++) {
+            float r = a[i][k];
+            if (r == 0)
+                continue;
+            for (int p = b.row_ptr[k]; p < b.row_ptr[k + 1]; p++) {
+                res[i][b.col[p]] += b.val[0][p] * r;
+            }
+        }
+    }
+}
+
+// res += a * b^T
+void sparse_multiply_transpose(Kernel& a, SparseMat& b, Kernel& res)
+{
+    perf::Scope scope("sparse_multiply_transpose");
+    assert(a.size.second == b.size.second);
+    assert(res.size.first == a.size.first && res.size.second == b.size.first);
+    for (int i = 0; i < a.size.first; i++) {
+        for (int k = 0; k < b.size.first; k++) {
+            float s = 0;
+            for (int p = b.row_ptr[k]; p < b.row_ptr[k + 1]; p++) {
+                s += a[i][b.col[p]] * b.val[0][p];
+            }
+            res[i][k] += s;
+        }
+    }
+}
+
+// grad += a^T * delta, evaluated only at the stored entries of pattern
+void sparse_outer(Kernel& a, Kernel& delta, SparseMat& pattern, Mat& grad)
+{
+    perf::Scope scope("sparse_outer");
+    assert(a.size.first == delta.size.first);
+    for (int m = 0; m < a.size.first; m++) {
+        for (int k = 0; k < pattern.size.first; k++) {
+            float r = a[m][k];
+            for (int p = pattern.row_ptr[k]; p < pattern.row_ptr[k + 1]; p++) {
+                grad[0][p] += r * delta[m][pattern.col[p]];
+            }
+        }
+    }
+}
+
+// sparse counterpart of the im2col convolution: row c * kernel_count + k of w
+// holds the weights of output channel k over input channel c
+void sparse_conv(SparseMat& w, Mat& data_col, int kernel_count, int out_len, Mat& out)
+{
+    perf::Scope scope("sparse_conv");
+    for (int r = 0; r < w.size.first; r++) {
+        int c = r / kernel_count, k = r % kernel_count;
+        auto dst = out[k];
+        for (int p = w.row_ptr[r]; p < w.row_ptr[r + 1]; p++) {
+            float v = w.val[0][p];
+            auto src = data_col[c] + w.col[p] * out_len;
+            for (int j = 0; j < out_len; j++) {
+                dst[j] += v * src[j];
+            }
+        }
+    }
+}
+
+void sparse_conv_prime(SparseMat& w, Mat& data_col, Mat& delta, int kernel_count, int out_len, Mat& delta_w, Mat& delta_col)
+{
+    perf::Scope scope("sparse_conv_prime");
+    for (int r = 0; r < w.size.first; r++) {
+        int c = r / kernel_count, k = r % kernel_count;
+        auto d = delta[k];
+        for (int p = w.row_ptr[r]; p < w.row_ptr[r + 1]; p++) {
+            float v = w.val[0][p];
+            auto src = data_col[c] + w.col[p] * out_len;
+            auto dst = delta_col[c] + w.col[p] * out_len;
+            float s = 0;
+            for (int j = 0; j < out_len; j++) {
+                s += d[j] * src[j];
+                dst[j] += v * d[j];
+            }
+            delta_w[0][p] += s;
+        }
+    }
+}
+
+enum Precision {
+    FP32,
+    FP16,
+    BF16
+};
+
+// IEEE binary16 with round to nearest even, overflow goes to infinity
+uint16_t float_to_half(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mant = x & 0x7fffff;
+    int exp = (x >> 23) & 0xff;
+    if (exp == 0xff)
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    int e = exp - 127 + 15;
+    if (e >= 0x1f)
+        return sign | 0x7c00;
+    if (e <= 0) {
+        if (e < -10)
+            return sign;
+        mant |= 0x800000;
+        int shift = 14 - e;
+        uint32_t half = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1), mid = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (half & 1)))
+            half++;
+        return sign | half;
+    }
+    uint32_t half = (e << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1)))
+        half++; // a carry into the exponent is still the correct rounding
+    return sign | half;
+}
+
+float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    int exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    if (exp == 0) {
+        float f = mant * (1.0f / (1 << 24));
+        return sign ? -f : f;
+    }
+    uint32_t x = sign | (exp == 0x1f ? 0x7f800000 | (mant << 13) : ((exp - 15 + 127) << 23) | (mant << 13));
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+uint16_t float_to_bfloat16(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7fffffff) > 0x7f800000)
+        return (x >> 16) | 0x40;
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+float bfloat16_to_float(uint16_t h)
+{
+    uint32_t x = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// rounds every entry to what storing it in the given precision would keep
+void round_to(Mat& in, Precision precision)
+{
+    if (precision == FP32)
+        return;
+    for (int i = 0; i < in.size.first; i++) {
+        for (int j = 0; j < in.size.second; j++) {
+            float v = in[i][j];
+            in[i][j] = precision == FP16 ? half_to_float(float_to_half(v)) : bfloat16_to_float(float_to_bfloat16(v));
+        }
+    }
+}
+
+// a Mat held in 16 bits per entry, or as is for FP32. packing a Mat already passed through
+// round_to loses nothing
+class PackedMat {
+    Precision precision = FP32;
+    Mat full;
+    vector<uint16_t, accounting::Allocator<uint16_t>> half;
+
+public:
+    pair<int, int> size;
+
+    PackedMat() { }
+
+    PackedMat(const Mat& in, Precision precision)
+        : precision(precision)
+        , size(in.size)
+    {
+        if (precision == FP32) {
+            full = in;
+            return;
+        }
+        Mat& src = const_cast<Mat&>(in);
+        half.resize((size_t)size.first * size.second);
+        for (int i = 0; i < size.first; i++) {
+            for (int j = 0; j < size.second; j++) {
+                float v = src[i][j];
+                half[(size_t)i * size.second + j] = precision == FP16 ? float_to_half(v) : float_to_bfloat16(v);
+            }
+        }
+    }
+
+    Mat unpack() const
+    {
+        if (precision == FP32)
+            return full;
+        Mat res(size.first, size.second);
+        for (int i = 0; i < size.first; i++) {
+            for (int j = 0; j < size.second; j++) {
+                uint16_t h = half[(size_t)i * size.second + j];
+                res[i][j] = precision == FP16 ? half_to_float(h) : bfloat16_to_float(h);
+            }
+        }
+        return res;
+    }
+
+    // storage in floats, a 16-bit entry counting for half of one
+    long floats() const
+    {
+        long n = (long)size.first * size.second;
+        return precision == FP32 ? n : (n + 1) / 2;
+    }
+};
+
+bool finite(Mat& in)
+{
+    for (int i = 0; i < in.size.first; i++) {
+        for (int j = 0; j < in.size.second; j++) {
+            if (!isfinite(in[i][j]))
+                return false;
+        }
+    }
+    return true;
+}
+
+// fused LSTM epilogue over one row of pre-activations laid out as [i | f | o | g]:
+// sigmoid on the first 3 * hidden entries, tanh on the last hidden entries
+void lstm_gates(Storage::iterator gates, int hidden)
+{
+    simd::sigmoid(&*gates, &*gates, 3 * hidden);
+    simd::tanh(&*gates + 3 * hidden, &*gates + 3 * hidden, hidden);
+}
+
 Mat concat(const Mat& a, const Mat& b)
 {
     assert(a.size.first == b.size.first);
@@ -637,6 +1528,25 @@ Mat concat(const Mat& a, const Mat& b)
     }
     return res;
 }
+
+// 8-bit image as decoded from disk, channel-major like the Mats
+struct ByteImage {
+    int channels = 0, height = 0, width = 0;
+    vector<uint8_t> pixels;
+
+    uint8_t* channel(int c) { return pixels.data() + c * height * width; }
+
+    // channels x (height * width), scaled to [0, 1]
+    Mat to_Mat()
+    {
+        Mat res(channels, height * width);
+        auto dst = res[0];
+        for (int i = 0; i < pixels.size(); i++) {
+            dst[i] = pixels[i] / 255.0f;
+        }
+        return res;
+    }
+};
 }
 
 #endif
\ No newline at end of file
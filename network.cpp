@@ -2,14 +2,19 @@
 
 #define NETWORK
 
+#include "checkpoint.cpp"
 #include "layer.cpp"
 #include "mutil.cpp"
 #include "optimizer.cpp"
+#include "telemetry.cpp"
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <numeric>
 #include <random>
-#include <time.h>
+#include <sstream>
+#include <stdexcept>
 #include <vector>
 
 #define endl '\n'
@@ -36,24 +41,172 @@ function<Mat(Mat&, Mat&)> CrossEntropy = [](Mat& res, Mat& ans) {
     return (ans / res) * -1.0f;
 };
 
+// everything needed to continue an interrupted train() exactly where it stopped
+struct TrainState {
+    int epoch = 0;
+    int index = 0; // position in order of the next sample
+    vector<int> order; // shuffle permutation of the current epoch
+    default_random_engine rng;
+};
+
 class Network {
 
 protected:
     vector<Layer*> layers;
     Optimizer* optimizer;
     int batch_size;
+    deque<Mat> scratch;
+    int segment_size = 0;
+    vector<mutil::PackedMat> boundaries; // input of every segment, kept while its caches are released
+    CheckpointWriter* checkpointWriter = nullptr;
+    bool checkpointState = false;
+    Precision precision = FP32;
+    Layout layout = NCHW; // preferred by layout-aware layers
+    int scale_window = 2000;
+    int good_steps = 0;
+    string metricsFile;
+    int metricsEvery = 100, batchesSinceExport = 0;
+    telemetry::Snapshot lastExport;
 
 public:
     function<Mat(Mat&, Mat&)> costfunc = [](Mat& res, Mat& ans) {
         return (res - ans) * (1.0f / ans.size.first / ans.size.second);
     };
-    int forwardTime = 0;
-    int backwardTime = 0;
+    shared_ptr<telemetry::Metrics> metrics = make_shared<telemetry::Metrics>();
+    vector<vector<int>> shapes; // shapes[i] is the input of layers[i], the last one the output
+    vector<Layout> layouts; // layout of the same activations
+    vector<string> names; // "index type" of every layer, as perf scopes report them
+    vector<vector<int>> tags; // accounting tag of every layer and role
+    long peakCache = 0; // floats cached for backward at the worst point of a step
+    long fullCache = 0; // the same without checkpointing
+    float loss_scale = 1;
+    int skippedSteps = 0;
+    TrainState state;
     Network(vector<Layer*> layers, Optimizer* optimizer, int batch_size)
         : batch_size(batch_size)
     {
         this->layers = layers;
         this->optimizer = optimizer;
+        nameLayers();
+    }
+
+    // input_shape is { channel, height, width }, layers may leave their input dimensions out
+    Network(vector<Layer*> layers, Optimizer* optimizer, int batch_size, vector<int> input_shape)
+        : Network(layers, optimizer, batch_size)
+    {
+        build(input_shape);
+    }
+
+    void build(vector<int> input_shape)
+    {
+        assignLayouts();
+        nameLayers();
+        shapes = { input_shape };
+        for (int i = 0; i < layers.size(); i++) {
+            accounting::Scope tag(tags[i][accounting::ACTIVATIONS]);
+            shapes.push_back(layers[i]->build(shapes.back()));
+        }
+        for (int i = 0; i < layers.size(); i++) {
+            if (!dynamic_cast<BatchNormLayer*>(layers[i]))
+                continue;
+            if (shapes[i][0] == 1 && shapes[i][1] == 1 && batch_size < 2)
+                throw invalid_argument("BatchNormLayer: a flat input needs batches of more than one sample");
+            if (!checkpointable(0, i))
+                throw invalid_argument("BatchNormLayer: can't follow a stateful layer, train recomputes the layers before it");
+        }
+        trackParameters();
+        shareScratch();
+    }
+
+    void nameLayers()
+    {
+        names.clear();
+        tags.clear();
+        for (auto layer : layers) {
+            names.push_back(to_string(names.size()) + " " + perf::type_name(typeid(*layer)));
+            tags.push_back({});
+            for (int role = 0; role < accounting::ROLES; role++) {
+                tags.back().push_back(accounting::tag(names.back(), (accounting::Role)role));
+            }
+        }
+    }
+
+    // layers allocate weights, gradients and caches together in build, this sorts them out
+    void trackParameters()
+    {
+        for (int i = 0; i < layers.size(); i++) {
+            for (auto weight : layers[i]->parameters()) {
+                weight->track(tags[i][accounting::WEIGHTS]);
+            }
+            for (auto grad : layers[i]->gradients()) {
+                grad->track(tags[i][accounting::GRADIENTS]);
+            }
+        }
+    }
+
+    // runs layout-aware layers (conv, pooling) in the given layout, the network input and
+    // output stay NCHW. takes effect immediately on a built network
+    void setLayout(Layout layout)
+    {
+        this->layout = layout;
+        if (!shapes.empty())
+            build(shapes.front());
+    }
+
+    // gives every layer a layout and puts a LayoutLayer wherever consecutive layouts differ,
+    // including at the network boundaries. layers without a preference keep their input's layout
+    void assignLayouts()
+    {
+        vector<Layer*> plain;
+        for (auto layer : layers) {
+            if (dynamic_cast<LayoutLayer*>(layer))
+                delete layer;
+            else
+                plain.push_back(layer);
+        }
+        layers.clear();
+        layouts = { NCHW };
+        for (auto layer : plain) {
+            vector<Layout> supported = layer->layouts();
+            Layout current = layouts.back(), next = current;
+            if (!supported.empty())
+                next = find(supported.begin(), supported.end(), layout) != supported.end() ? layout : supported[0];
+            if (next != current) {
+                layers.push_back(new LayoutLayer(current, next));
+                layouts.push_back(next);
+            }
+            layer->setLayout(next);
+            layers.push_back(layer);
+            layouts.push_back(next);
+        }
+        if (layouts.back() != NCHW) {
+            layers.push_back(new LayoutLayer(layouts.back(), NCHW));
+            layouts.push_back(NCHW);
+        }
+    }
+
+    // only one layer runs at a time, so every layer shares the scratch buffers: slot k is
+    // allocated once, sized for the layer needing the most in it
+    void shareScratch()
+    {
+        vector<int> scratch_size;
+        for (auto layer : layers) {
+            vector<int> sizes = layer->scratchSizes();
+            for (int slot = 0; slot < sizes.size(); slot++) {
+                if (scratch_size.size() <= slot)
+                    scratch_size.push_back(0);
+                scratch_size[slot] = max(scratch_size[slot], sizes[slot]);
+            }
+        }
+        scratch = deque<Mat>(scratch_size.size());
+        int scratch_tag = accounting::tag("network", accounting::SCRATCH);
+        for (int slot = 0; slot < scratch_size.size(); slot++) {
+            scratch[slot].reshape(1, scratch_size[slot]);
+            scratch[slot].track(scratch_tag);
+        }
+        for (auto layer : layers) {
+            layer->bindScratch(&scratch);
+        }
     }
 
     void init(int seed)
@@ -73,46 +226,662 @@ public:
         }
     }
 
+    // keeps only the input of every segment_size layers and recomputes the rest
+    // during backward, trading one extra forward pass for activation memory.
+    // around sqrt(layers.size()) is the usual balance, 0 turns it off
+    void setCheckpointing(int segment_size)
+    {
+        this->segment_size = segment_size;
+    }
+
+    // activations and gradients are rounded to precision between layers while weights
+    // stay fp32. the loss is multiplied by a dynamic scale so small gradients survive
+    // fp16, halved on overflow and doubled after scale_window clean steps. layers still
+    // compute and cache in fp32, so this emulates the numerics; only the checkpointed
+    // segment inputs are actually stored in 16 bits. FP32, the default, skips rounding
+    void setMixedPrecision(Precision precision, float initial_scale = 65536, int scale_window = 2000)
+    {
+        this->precision = precision;
+        this->scale_window = scale_window;
+        loss_scale = precision == FP32 ? 1 : initial_scale;
+        good_steps = 0;
+    }
+
     Mat forward(Mat in)
     {
-        auto start = clock();
-        for (auto layer : layers) {
-            in = layer->forward(in);
+        telemetry::Timer timer(metrics->forward);
+        int n = layers.size(), seg = segment_size ? segment_size : n;
+        long full = 0;
+        boundaries.clear();
+        if (precision != FP32)
+            mutil::round_to(in, precision); // so a recomputed first segment sees what was packed
+        for (int i = 0; i < n; i++) {
+            if (segment_size && i % seg == 0)
+                boundaries.push_back(mutil::PackedMat(in, precision));
+            perf::Scope scope(names[i], "forward");
+            accounting::Scope tag(tags[i][accounting::ACTIVATIONS]);
+            in = layers[i]->forward(in);
+            if (precision != FP32)
+                mutil::round_to(in, precision);
+            full += layers[i]->cacheSize();
+            trackPeak();
+            // the last segment is the first one backward needs, keep it
+            if (segment_size && i % seg == seg - 1 && i < (n - 1) / seg * seg)
+                release(i + 1 - seg, i + 1);
         }
-        auto end = clock();
-        forwardTime += end - start;
+        fullCache = max(fullCache, full);
         return in;
     }
 
     void backPropagation(Mat result, Mat answer)
     {
-        auto start = clock();
-        Mat delta = costfunc(result, answer);
-        for (int i = layers.size() - 1; i >= 0; i--) {
+        telemetry::Timer timer(metrics->backward);
+        Mat delta = lossGradient(result, answer);
+        int n = layers.size(), seg = segment_size ? segment_size : n;
+        for (int s = (n - 1) / seg; s >= 0; s--) {
+            int begin = s * seg, end = min(n, begin + seg);
+            if (segment_size && s < (n - 1) / seg && checkpointable(begin, end)) {
+                forward(boundaries[s].unpack(), begin, end);
+                trackPeak();
+            }
+            delta = backward(move(delta), begin, end);
+            if (segment_size) {
+                release(begin, end);
+                boundaries[s] = mutil::PackedMat();
+            }
+        }
+    }
+
+    // layers[begin, end) on one sample, rounded to precision after every layer
+    Mat forward(Mat in, int begin, int end)
+    {
+        for (int i = begin; i < end; i++) {
+            perf::Scope scope(names[i], "forward");
+            accounting::Scope tag(tags[i][accounting::ACTIVATIONS]);
+            in = layers[i]->forward(in);
+            if (precision != FP32)
+                mutil::round_to(in, precision);
+        }
+        return in;
+    }
+
+    Mat backward(Mat delta, int begin, int end)
+    {
+        for (int i = end - 1; i >= begin; i--) {
+            perf::Scope scope(names[i], "backward");
+            accounting::Scope tag(tags[i][accounting::GRADIENTS]);
             delta = layers[i]->backward(delta);
+            if (precision != FP32)
+                mutil::round_to(delta, precision);
+        }
+        return delta;
+    }
+
+    // costfunc's gradient at result, loss scaled, and the sample recorded in metrics
+    Mat lossGradient(Mat& result, Mat& answer)
+    {
+        record(result, answer);
+        Mat delta = costfunc(result, answer);
+        if (precision != FP32) {
+            delta * loss_scale;
+            mutil::round_to(delta, precision);
+        }
+        return delta;
+    }
+
+    // squared error and argmax hit of a trained sample, whatever costfunc is
+    void record(Mat& result, Mat& answer)
+    {
+        long n = (long)result.size.first * result.size.second;
+        auto out = result[0], ans = answer[0];
+        double loss = 0;
+        for (long i = 0; i < n; i++) {
+            loss += (out[i] - ans[i]) * (out[i] - ans[i]);
+        }
+        metrics->sample(loss, max_element(out, out + n) - out == max_element(ans, ans + n) - ans);
+    }
+
+    // writes the metrics in the Prometheus text format to path every that many batches,
+    // with throughput, loss and accuracy over the batches since the previous write
+    void setMetricsFile(string path, int every = 100)
+    {
+        metricsFile = path;
+        metricsEvery = every;
+        batchesSinceExport = 0;
+        lastExport = telemetry::snapshot(*metrics);
+    }
+
+    void exportMetrics()
+    {
+        telemetry::Snapshot now = telemetry::snapshot(*metrics);
+        telemetry::writePrometheusFile(metricsFile, now, &lastExport);
+        lastExport = now;
+        batchesSinceExport = 0;
+    }
+
+    void checkpointReport(ostream& os)
+    {
+        os << "activation cache peak: " << peakCache * sizeof(float) << " bytes, without checkpointing: "
+           << fullCache * sizeof(float) << " bytes" << endl;
+    }
+
+    void train(vector<pair<Mat, Mat>>& data, default_random_engine e)
+    {
+        state.rng = e;
+        train(data);
+    }
+
+    // one epoch over data, continuing from state when it was restored mid-epoch
+    void train(vector<pair<Mat, Mat>>& data)
+    {
+        vector<pair<Mat, Mat>*> batch;
+        beginEpoch(data.size());
+        while (state.index < data.size()) {
+            int end = min<int>(data.size(), state.index + batch_size);
+            batch.clear();
+            for (int index = state.index; index < end; index++) {
+                batch.push_back(&data[state.order[index]]);
+            }
+            accumulate(batch);
+            state.index = end;
+            update();
+        }
+        endEpoch();
+    }
+
+    // the same over size samples fetched by index, such as a DatasetCache's, so a sample only
+    // exists while its batch trains
+    void train(int size, function<pair<Mat, Mat>(int)> sample)
+    {
+        vector<pair<Mat, Mat>> fetched;
+        vector<pair<Mat, Mat>*> batch;
+        beginEpoch(size);
+        while (state.index < size) {
+            int end = min(size, state.index + batch_size);
+            fetched.clear();
+            batch.clear();
+            for (int index = state.index; index < end; index++) {
+                fetched.push_back(sample(state.order[index]));
+            }
+            for (auto& sample : fetched) {
+                batch.push_back(&sample);
+            }
+            accumulate(batch);
+            state.index = end;
+            update();
+        }
+        endEpoch();
+    }
+
+    // shuffles a new epoch over size samples with state.rng, unless state holds one in progress
+    void beginEpoch(int size)
+    {
+        if ((int)state.order.size() != size) {
+            state.order = vector<int>(size);
+            iota(state.order.begin(), state.order.end(), 0);
+            shuffle(state.order.begin(), state.order.end(), state.rng);
+            state.index = 0;
+        }
+    }
+
+    void endEpoch()
+    {
+        state.epoch++;
+        state.order.clear();
+        state.index = 0;
+    }
+
+    // one epoch from a batch source such as Augmenter::source(), which returns false at its end.
+    // the source owns the order, so only the epoch counter is tracked in state
+    void train(function<bool(vector<pair<Mat, Mat>>&)> next)
+    {
+        vector<pair<Mat, Mat>> batch;
+        vector<pair<Mat, Mat>*> samples;
+        while (next(batch)) {
+            samples.clear();
+            for (auto& sample : batch) {
+                samples.push_back(&sample);
+            }
+            accumulate(samples);
+            update();
+        }
+        state.epoch++;
+    }
+
+    // forward and backward over a batch, accumulating its gradients. one sample at a time
+    // unless there are BatchNormLayers, see normalizedBatch
+    void accumulate(vector<pair<Mat, Mat>*>& batch)
+    {
+        vector<int> norms;
+        for (int i = 0; i < layers.size(); i++) {
+            if (dynamic_cast<BatchNormLayer*>(layers[i]))
+                norms.push_back(i);
+        }
+        if (!norms.empty()) {
+            normalizedBatch(batch, norms);
+            return;
+        }
+        for (auto sample : batch) {
+            Mat result = forward(sample->first);
+            backPropagation(result, sample->second);
+        }
+    }
+
+    // runs the whole batch through the layers up to each BatchNormLayer before the layer
+    // normalizes it with the batch statistics. the inputs of every such range are kept per
+    // sample, and backward recomputes a range from them before running it backward, as
+    // checkpointing does, so the layers' single-sample caches stay valid. the layers after the
+    // last normalization run forward and backward per sample. the forward and backward
+    // histograms time whole batches here, and setCheckpointing has no effect
+    void normalizedBatch(vector<pair<Mat, Mat>*>& batch, vector<int>& norms)
+    {
+        int n = layers.size(), count = batch.size(), ranges = norms.size();
+        vector<vector<Mat>> inputs(ranges);
+        vector<Mat> acts, deltas(count);
+        {
+            telemetry::Timer timer(metrics->forward);
+            for (auto sample : batch) {
+                acts.push_back(sample->first);
+                if (precision != FP32)
+                    mutil::round_to(acts.back(), precision);
+            }
+            for (int r = 0, begin = 0; r < ranges; begin = norms[r++] + 1) {
+                inputs[r] = acts;
+                for (auto& act : acts) {
+                    act = forward(move(act), begin, norms[r]);
+                }
+                perf::Scope scope(names[norms[r]], "forward");
+                accounting::Scope tag(tags[norms[r]][accounting::ACTIVATIONS]);
+                ((BatchNormLayer*)layers[norms[r]])->batchForward(acts);
+                for (auto& act : acts) {
+                    if (precision != FP32)
+                        mutil::round_to(act, precision);
+                }
+            }
+        }
+        telemetry::Timer timer(metrics->backward);
+        for (int s = 0; s < count; s++) {
+            Mat result = forward(move(acts[s]), norms.back() + 1, n);
+            deltas[s] = backward(lossGradient(result, batch[s]->second), norms.back() + 1, n);
+        }
+        for (int r = ranges - 1; r >= 0; r--) {
+            {
+                perf::Scope scope(names[norms[r]], "backward");
+                accounting::Scope tag(tags[norms[r]][accounting::GRADIENTS]);
+                ((BatchNormLayer*)layers[norms[r]])->batchBackward(deltas);
+            }
+            int begin = r ? norms[r - 1] + 1 : 0;
+            for (int s = 0; s < count; s++) {
+                if (precision != FP32)
+                    mutil::round_to(deltas[s], precision);
+                forward(move(inputs[r][s]), begin, norms[r]);
+                deltas[s] = backward(move(deltas[s]), begin, norms[r]);
+            }
+        }
+    }
+
+    // applies the accumulated gradients of a batch and takes a checkpoint when one is due
+    void update()
+    {
+        if (unscaleGradients()) {
+            telemetry::Timer timer(metrics->learn);
+            for (int i = 0; i < layers.size(); i++) {
+                // optimizers hand back fresh storage for the weights
+                accounting::Scope tag(tags[i][accounting::WEIGHTS]);
+                layers[i]->learn(optimizer);
+            }
+        }
+        if (checkpointWriter && checkpointWriter->due())
+            checkpointWriter->save(checkpointState ? stateSnapshot() : snapshot());
+        accounting::step();
+        if (!metricsFile.empty() && ++batchesSinceExport == metricsEvery)
+            exportMetrics();
+    }
+
+    // divides the loss scale back out of the accumulated gradients, on overflow the
+    // batch is dropped and the scale halved
+    bool unscaleGradients()
+    {
+        if (precision == FP32)
+            return true;
+        bool overflow = false;
+        for (auto layer : layers) {
+            for (auto grad : layer->gradients()) {
+                overflow |= !mutil::finite(*grad);
+            }
+        }
+        for (auto layer : layers) {
+            for (auto grad : layer->gradients()) {
+                if (overflow)
+                    grad->clear();
+                else
+                    *grad * (1 / loss_scale);
+            }
+        }
+        if (overflow) {
+            loss_scale = max(1.0f, loss_scale / 2);
+            good_steps = 0;
+            skippedSteps++;
+            return false;
+        }
+        if (++good_steps == scale_window) {
+            loss_scale *= 2;
+            good_steps = 0;
+        }
+        return true;
+    }
+
+    bool checkpointable(int begin, int end)
+    {
+        for (int i = begin; i < end; i++) {
+            if (layers[i]->stateful())
+                return false;
+        }
+        return true;
+    }
+
+    void release(int begin, int end)
+    {
+        if (!checkpointable(begin, end))
+            return;
+        for (int i = begin; i < end; i++) {
+            layers[i]->release();
+        }
+    }
+
+    void trackPeak()
+    {
+        long live = 0;
+        for (auto layer : layers) {
+            live += layer->cacheSize();
+        }
+        for (auto& boundary : boundaries) {
+            live += boundary.floats();
+        }
+        peakCache = max(peakCache, live);
+    }
+
+    void prune(float sparsity)
+    {
+        for (auto layer : layers) {
+            layer->prune(sparsity);
+        }
+        // pruned layers fall back to NCHW
+        if (!shapes.empty())
+            build(shapes.front());
+    }
+
+    enum Saliency {
+        NORM, // L1 norm of the kernel
+        TAYLOR // (sum of weight * gradient)^2 over calibration samples
+    };
+
+    // structured pruning: removes the given fraction of output kernels from every ConvLayer, the
+    // least salient first, together with the matching input channels of the layers up to the
+    // next ConvLayer or DenseLayer, leaving a smaller dense network. a BatchNormLayer in between
+    // weights the ranks by its scale. convs feeding the output or a layer that can't lose
+    // channels are kept whole. TAYLOR runs forward and backward over calibration one sample at
+    // a time without learning, so normalization layers use their running averages and keep them,
+    // and the metrics stay as they were; without calibration it ranks like NORM. fine-tune with train() afterwards. returns the number of
+    // kernels removed
+    int pruneChannels(float fraction, Saliency by = NORM, vector<pair<Mat, Mat>>* calibration = nullptr)
+    {
+        if (by == TAYLOR && calibration) {
+            shared_ptr<telemetry::Metrics> kept = metrics;
+            metrics = make_shared<telemetry::Metrics>();
+            clearGradients();
+            for (auto& sample : *calibration) {
+                backPropagation(forward(sample.first), sample.second);
+            }
+            metrics = kept;
         }
-        auto end = clock();
-        backwardTime += end - start;
+        int removed = 0;
+        for (int i = 0; i < layers.size(); i++) {
+            auto conv = dynamic_cast<ConvLayer*>(layers[i]);
+            if (!conv)
+                continue;
+            // the layers whose input channels are the conv's kernels, ending with their consumer
+            vector<int> chain;
+            bool consumed = false;
+            for (int j = i + 1; j < layers.size() && !consumed; j++) {
+                if (layers[j]->channelUse() == Layer::BLOCKS)
+                    break;
+                consumed = layers[j]->channelUse() == Layer::CONSUMES;
+                chain.push_back(j);
+            }
+            if (!consumed)
+                continue;
+            vector<float> saliency = conv->saliency(by == TAYLOR && calibration);
+            int kernels = saliency.size();
+            for (int j : chain) {
+                auto norm = dynamic_cast<BatchNormLayer*>(layers[j]);
+                Mat scale, shift;
+                if (norm && norm->gamma.size.second == kernels) {
+                    norm->affine(scale, shift);
+                    for (int k = 0; k < kernels; k++) {
+                        saliency[k] *= fabs(scale[0][k]);
+                    }
+                }
+            }
+            vector<int> keep(kernels);
+            iota(keep.begin(), keep.end(), 0);
+            stable_sort(keep.begin(), keep.end(), [&](int a, int b) { return saliency[a] > saliency[b]; });
+            keep.resize(max(1, kernels - (int)(fraction * kernels + 0.5f)));
+            sort(keep.begin(), keep.end());
+            if (keep.size() == kernels)
+                continue;
+            conv->keepOutputs(keep);
+            int area = shapes[i + 1][1] * shapes[i + 1][2];
+            for (int j : chain) {
+                layers[j]->keepInputs(keep, area);
+                if (shapes[j + 1][0] != 1 || shapes[j + 1][1] != 1)
+                    area = shapes[j + 1][1] * shapes[j + 1][2];
+            }
+            removed += kernels - keep.size();
+        }
+        if (by == TAYLOR && calibration)
+            clearGradients();
+        if (removed)
+            build(shapes.front());
+        return removed;
     }
 
-    void train(vector<pair<Mat, Mat>>& data, default_random_engine e = default_random_engine())
+    void clearGradients()
     {
-        shuffle(data.begin(), data.end(), e);
-        int index = 0;
-        for (; index < data.size(); index++) {
-            Mat result = forward(data[index].first);
-            backPropagation(result, data[index].second);
-            for (index++; index % batch_size && index < data.size(); index++) {
-                Mat result = forward(data[index].first);
-                backPropagation(result, data[index].second);
+        for (auto layer : layers) {
+            for (auto grad : layer->gradients()) {
+                grad->clear();
             }
-            for (auto layer : layers) {
-                layer->learn(optimizer);
+        }
+    }
+
+    // of one forward pass, for comparing pruned networks
+    long multiplyAdds()
+    {
+        long total = 0;
+        for (auto layer : layers) {
+            total += layer->multiplyAdds();
+        }
+        return total;
+    }
+
+    // folds every BatchNormLayer into the ConvLayer or DenseLayer before it and drops it, for
+    // deployment. outputs stay the same up to rounding, returns the number of layers folded
+    int foldBatchNorm()
+    {
+        vector<Layer*> kept;
+        int folded = 0;
+        for (auto layer : layers) {
+            auto norm = dynamic_cast<BatchNormLayer*>(layer);
+            Layer* previous = nullptr;
+            for (int i = kept.size() - 1; i >= 0 && !previous; i--) {
+                if (!dynamic_cast<LayoutLayer*>(kept[i]))
+                    previous = kept[i];
+            }
+            if (norm && previous && norm->foldInto(previous)) {
+                delete norm;
+                folded++;
+                continue;
+            }
+            kept.push_back(layer);
+        }
+        layers = kept;
+        if (folded && !shapes.empty())
+            build(shapes.front());
+        return folded;
+    }
+
+    // writes a self-contained header with the weights compiled in as constexpr arrays and
+    // name::forward(in, out) running inference on two stack buffers, no file I/O at startup.
+    // needs the shapes from build, false if a layer has no code generator (recurrent layers)
+    // or runs in a layout other than NCHW
+    bool exportBundle(ostream& out, string name)
+    {
+        if (shapes.size() != layers.size() + 1)
+            return false;
+        int n = layers.size(), largest = 0;
+        for (int i = 1; i < n; i++) {
+            largest = max(largest, shapes[i][0] * shapes[i][1] * shapes[i][2]);
+        }
+        stringstream weights, body;
+        for (int i = 0; i < n; i++) {
+            string prefix = "layer" + to_string(i);
+            layers[i]->emitWeights(weights, prefix);
+            body << "    // layer " << i << "\n";
+            body << "    {\n";
+            body << "    const float* src = " << (i == 0 ? "in" : "buffer[" + to_string((i - 1) % 2) + "]") << ";\n";
+            body << "    float* dst = " << (i == n - 1 ? "out" : "buffer[" + to_string(i % 2) + "]") << ";\n";
+            if (!layers[i]->emitForward(body, prefix, shapes[i]))
+                return false;
+            body << "    }\n";
+        }
+        vector<int>& in = shapes.front();
+        vector<int>& res = shapes.back();
+        out << "// generated by Network::exportBundle, do not edit\n";
+        out << "#pragma once\n\n";
+        out << "#include <algorithm>\n#include <cfloat>\n#include <cmath>\n\n";
+        out << "namespace " << name << " {\n\n";
+        out << "static constexpr int input_size = " << in[0] * in[1] * in[2] << ";\n";
+        out << "static constexpr int output_size = " << res[0] * res[1] * res[2] << ";\n\n";
+        out << weights.str() << "\n";
+        out << "// in holds input_size floats laid out channel, height, width\n";
+        out << "inline void forward(const float* in, float* out)\n{\n";
+        if (n > 1)
+            out << "    alignas(64) float buffer[2][" << largest << "];\n";
+        out << body.str();
+        out << "}\n\n}\n";
+        return true;
+    }
+
+    // periodic checkpoints during train, nullptr turns them off. with full_state
+    // they hold the resumable training state instead of the weights only
+    void setCheckpointWriter(CheckpointWriter* writer, bool full_state = false)
+    {
+        checkpointWriter = writer;
+        checkpointState = full_state;
+    }
+
+    // binary snapshot of model, gradients, optimizer, loss scaling, RNG, epoch and cursor
+    void saveState(ostream& out)
+    {
+        int32_t head[4] = { 0x4e4e5043, 1, stateLayers(), (int32_t)state.order.size() }; // "CPNN", version
+        out.write((char*)head, sizeof(head));
+        for (auto layer : layers) {
+            layer->saveState(out);
+        }
+        optimizer->saveState(out);
+        int32_t progress[4] = { state.epoch, state.index, good_steps, skippedSteps };
+        out.write((char*)progress, sizeof(progress));
+        out.write((char*)&loss_scale, sizeof(loss_scale));
+        out.write((char*)state.order.data(), sizeof(int) * state.order.size());
+        ostringstream rng;
+        rng << state.rng;
+        int32_t length = rng.str().size();
+        out.write((char*)&length, sizeof(length));
+        out.write(rng.str().data(), length);
+    }
+
+    // the layers a state counts, LayoutLayers hold none and depend on the layout
+    int stateLayers()
+    {
+        int count = 0;
+        for (auto layer : layers) {
+            count += !dynamic_cast<LayoutLayer*>(layer);
+        }
+        return count;
+    }
+
+    // false on a state of another network or a truncated or corrupt one. sizes from the file
+    // are checked before they are used, the order is read in chunks so a wrong length runs
+    // into the end of the file instead of allocating it
+    bool loadState(istream& in)
+    {
+        int32_t head[4];
+        in.read((char*)head, sizeof(head));
+        if (!in || head[0] != 0x4e4e5043 || head[1] != 1 || head[2] != stateLayers() || head[3] < 0) {
+            cout << "Error: incompatible training state" << endl;
+            return false;
+        }
+        for (int i = 0; i < layers.size() && in; i++) {
+            accounting::Scope tag(tags[i][accounting::WEIGHTS]);
+            layers[i]->loadState(in);
+        }
+        trackParameters();
+        if (in)
+            optimizer->loadState(in);
+        int32_t progress[4];
+        float scale;
+        in.read((char*)progress, sizeof(progress));
+        in.read((char*)&scale, sizeof(scale));
+        vector<int> order;
+        for (int32_t left = head[3]; left > 0 && in;) {
+            int chunk = min(left, 1 << 16);
+            order.resize(order.size() + chunk);
+            in.read((char*)(order.data() + order.size() - chunk), sizeof(int) * chunk);
+            left -= chunk;
+        }
+        int32_t length = -1;
+        in.read((char*)&length, sizeof(length));
+        if (!in || progress[1] < 0 || progress[1] > head[3] || length < 0 || length > 1 << 16) {
+            cout << "Error: corrupt training state" << endl;
+            return false;
+        }
+        for (int index : order) {
+            if (index < 0 || index >= head[3]) {
+                cout << "Error: corrupt training state" << endl;
+                return false;
             }
-            if (index % (batch_size * 100) == 0)
-                cout << "Processing Batches : " << ((index + 1) / batch_size) << "/"
-                     << (data.size() / batch_size) << endl;
         }
+        string text(length, ' ');
+        in.read(&text[0], length);
+        istringstream rng(text);
+        rng >> state.rng;
+        if (!in || !rng) {
+            cout << "Error: corrupt training state" << endl;
+            return false;
+        }
+        state.epoch = progress[0], state.index = progress[1], good_steps = progress[2], skippedSteps = progress[3];
+        loss_scale = scale;
+        state.order = order;
+        return true;
+    }
+
+    // serialized on the calling thread, binary is cheap enough for a memcpy-like pause
+    Snapshot stateSnapshot()
+    {
+        ostringstream buffer;
+        saveState(buffer);
+        string data = buffer.str();
+        return { [data](ofstream& out) { out.write(data.data(), data.size()); } };
+    }
+
+    Snapshot snapshot()
+    {
+        Snapshot ret;
+        for (auto layer : layers) {
+            ret.push_back(layer->snapshot());
+        }
+        return ret;
     }
 
     void saveCheckpoint(ofstream& out)
@@ -124,9 +893,11 @@ public:
 
     void loadCheckpoint(ifstream& in)
     {
-        for (auto layer : layers) {
-            layer->loadCheckpoint(in);
+        for (int i = 0; i < layers.size(); i++) {
+            accounting::Scope tag(tags[i][accounting::WEIGHTS]);
+            layers[i]->loadCheckpoint(in);
         }
+        trackParameters();
     }
 };
 
@@ -13,6 +13,9 @@ class Optimizer {
 
 public:
     virtual Mat optimize(Mat& mat, Mat& nabla) = 0;
+    // binary state for resuming, e.g. moments of stateful optimizers
+    virtual void saveState(ostream& out) { }
+    virtual void loadState(istream& in) { }
 };
 
 class SDG : public Optimizer {
@@ -0,0 +1,301 @@
+#ifndef PERF_CPP
+#define PERF_CPP
+
+#include "threadpool.cpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// optional hardware counter instrumentation. once enabled, every Scope adds the wall time and the
+// cycles, instructions, cache and branch misses spent inside it to a per-name total. counters are
+// inherited by threads started after enable(), so the pool's workers are included. scopes are
+// inclusive and only recorded on the enabling thread outside parallel_for bodies, work done by
+// workers is counted in the scope that started it. without perf_event_open (other platforms,
+// containers, a high perf_event_paranoid) only the timings are reported
+namespace perf {
+
+enum Event {
+    CYCLES,
+    INSTRUCTIONS,
+    L1D_MISSES,
+    LLC_MISSES,
+    BRANCH_MISSES,
+    EVENTS
+};
+
+struct Totals {
+    long calls = 0;
+    double seconds = 0;
+    long long count[EVENTS] = {};
+};
+
+class Counters {
+    int fds[EVENTS];
+
+public:
+    Counters()
+    {
+        fill(fds, fds + EVENTS, -1);
+    }
+
+    ~Counters()
+    {
+        close();
+    }
+
+    // opens whatever events the kernel lets us have, false if none
+    bool open()
+    {
+        close();
+#ifdef __linux__
+        const pair<uint32_t, uint64_t> events[EVENTS] = {
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        };
+        for (int i = 0; i < EVENTS; i++) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = events[i].first;
+            attr.config = events[i].second;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            // not grouped, inherited groups can't be read, so scale for multiplexing instead
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+#endif
+        return available();
+    }
+
+    void close()
+    {
+#ifdef __linux__
+        for (int& fd : fds) {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+
+    bool available(int event) { return fds[event] >= 0; }
+
+    bool available()
+    {
+        for (int i = 0; i < EVENTS; i++) {
+            if (available(i))
+                return true;
+        }
+        return false;
+    }
+
+    // current values, 0 for events that aren't available
+    void read(long long* values)
+    {
+        for (int i = 0; i < EVENTS; i++) {
+            values[i] = 0;
+#ifdef __linux__
+            uint64_t data[3];
+            if (fds[i] >= 0 && ::read(fds[i], data, sizeof(data)) == sizeof(data) && data[2] > 0)
+                values[i] = data[2] == data[1] ? data[0] : (long long)((double)data[0] * data[1] / data[2]);
+#endif
+        }
+    }
+};
+
+struct Profile {
+    bool enabled = false;
+    thread::id owner;
+    Counters counters;
+    mutex lock;
+    map<string, Totals> totals;
+    vector<string> order; // names in the order they were first seen
+};
+
+static Profile& profile()
+{
+    static Profile p;
+    return p;
+}
+
+// starts recording on the calling thread and restarts the pool so its workers inherit the
+// counters. false if no hardware counter could be opened, the timings are recorded anyway
+static inline bool enable()
+{
+    Profile& p = profile();
+    bool ok = p.counters.open();
+    pool::configure(pool::threads(), pool::instance()->pinned);
+    p.owner = this_thread::get_id();
+    p.enabled = true;
+    return ok;
+}
+
+// stops recording, the totals stay until reset()
+static inline void disable()
+{
+    profile().enabled = false;
+}
+
+static inline void reset()
+{
+    lock_guard<mutex> guard(profile().lock);
+    profile().totals.clear();
+    profile().order.clear();
+}
+
+// whether the CPPNN_PERF environment variable asks for recording, anything but empty or 0 does.
+// lets a build be profiled without editing it: if (perf::requested()) perf::enable();
+static inline bool requested()
+{
+    const char* value = getenv("CPPNN_PERF");
+    return value && *value && strcmp(value, "0") != 0;
+}
+
+// readable name of a polymorphic type, for naming layers
+static string type_name(const type_info& type)
+{
+#ifdef __GNUG__
+    int status = 0;
+    char* name = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+    if (status == 0 && name) {
+        string res = name;
+        free(name);
+        return res;
+    }
+#endif
+    return type.name();
+}
+
+// adds the time and counts between construction and destruction to totals[name] or
+// totals[base + " " + name]. costs one branch while profiling is off
+class Scope {
+    const string* base = nullptr;
+    const char* name;
+    bool active;
+    string key;
+    chrono::steady_clock::time_point start;
+    long long begin[EVENTS];
+
+public:
+    Scope(const char* name)
+        : name(name)
+        , active(recording())
+    {
+        if (active)
+            open();
+    }
+
+    Scope(const string& base, const char* name)
+        : base(&base)
+        , name(name)
+        , active(recording())
+    {
+        if (active)
+            open();
+    }
+
+    ~Scope()
+    {
+        if (!active)
+            return;
+        long long end[EVENTS];
+        profile().counters.read(end);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        Profile& p = profile();
+        lock_guard<mutex> guard(p.lock);
+        Totals& totals = p.totals[key];
+        totals.calls++;
+        totals.seconds += seconds;
+        for (int i = 0; i < EVENTS; i++) {
+            totals.count[i] += end[i] - begin[i];
+        }
+    }
+
+private:
+    // kernels called from inside a parallel_for would only see the caller's share
+    static bool recording()
+    {
+        return profile().enabled && this_thread::get_id() == profile().owner && !pool::in_parallel();
+    }
+
+    // registered on entry so the report lists enclosing scopes before the kernels they call
+    void open()
+    {
+        key = base ? *base + " " + name : string(name);
+        {
+            Profile& p = profile();
+            lock_guard<mutex> guard(p.lock);
+            if (!p.totals.count(key)) {
+                p.order.push_back(key);
+                p.totals[key];
+            }
+        }
+        profile().counters.read(begin);
+        start = chrono::steady_clock::now();
+    }
+};
+
+// one line per scope: calls, milliseconds, then the counters with IPC and miss rates per
+// thousand instructions, n/a for counters that couldn't be opened. nothing if nothing was recorded
+static void report(ostream& os)
+{
+    Profile& p = profile();
+    lock_guard<mutex> guard(p.lock);
+    if (p.order.empty())
+        return;
+    auto counter = [&](Totals& t, Event e) -> string {
+        return p.counters.available(e) ? to_string(t.count[e]) : "n/a";
+    };
+    auto rate = [&](Totals& t, Event e) -> string {
+        if (!p.counters.available(e) || !p.counters.available(INSTRUCTIONS) || t.count[INSTRUCTIONS] == 0)
+            return "n/a";
+        ostringstream ss;
+        ss << fixed << setprecision(2) << 1000.0 * t.count[e] / t.count[INSTRUCTIONS];
+        return ss.str();
+    };
+    os << left << setw(32) << "scope" << right << setw(9) << "calls" << setw(11) << "ms" << setw(15) << "cycles"
+       << setw(15) << "instructions" << setw(7) << "IPC" << setw(10) << "L1d/ki" << setw(10) << "LLC/ki" << setw(10) << "br/ki" << '\n';
+    for (auto& name : p.order) {
+        Totals& t = p.totals[name];
+        string ipc = "n/a";
+        if (p.counters.available(CYCLES) && p.counters.available(INSTRUCTIONS) && t.count[CYCLES] > 0) {
+            ostringstream ss;
+            ss << fixed << setprecision(2) << (double)t.count[INSTRUCTIONS] / t.count[CYCLES];
+            ipc = ss.str();
+        }
+        os << left << setw(32) << name << right << setw(9) << t.calls << setw(11) << fixed << setprecision(1) << t.seconds * 1000 << defaultfloat
+           << setw(15) << counter(t, CYCLES) << setw(15) << counter(t, INSTRUCTIONS) << setw(7) << ipc
+           << setw(10) << rate(t, L1D_MISSES) << setw(10) << rate(t, LLC_MISSES) << setw(10) << rate(t, BRANCH_MISSES) << '\n';
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,386 @@
+#ifndef SERVER_CPP
+#define SERVER_CPP
+
+#include "network.cpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace mutil;
+
+struct ServerStats {
+    long requests = 0, batches = 0;
+    vector<long> batch_sizes; // batch_sizes[n] batches of n requests
+    double queue_total_us = 0, queue_max_us = 0; // from submit until its batch starts
+    double service_total_us = 0; // running the batches
+};
+
+// coalesces concurrent requests into batches of at most max_batch, waiting at most max_wait_us
+// after the oldest queued request, and runs them on one network replica per worker. a batch is
+// only formed once a replica is free, so under load the queue grows into full batches instead
+// of dispatching singles. the layers take one sample at a time, batching amortizes the hand-off
+// and wakeups and lets the replicas run in parallel
+class BatchServer {
+    struct Request {
+        Mat input;
+        promise<Mat> result;
+        chrono::steady_clock::time_point submitted;
+    };
+
+    vector<unique_ptr<Network>> replicas;
+    vector<thread> workers;
+    thread batcher;
+    mutex lock;
+    condition_variable cv;
+    deque<unique_ptr<Request>> queue;
+    deque<vector<unique_ptr<Request>>> batches;
+    int idle = 0;
+    bool stop = false;
+    ServerStats totals;
+
+public:
+    shared_ptr<telemetry::Metrics> metrics = make_shared<telemetry::Metrics>(); // of every replica
+    const int max_batch;
+    const long max_wait_us;
+    vector<int> input_shape;
+    int output_size;
+
+    // factory builds one network with its weights loaded, called once per worker
+    BatchServer(function<Network*()> factory, int workers = 2, int max_batch = 16, long max_wait_us = 2000)
+        : max_batch(max_batch)
+        , max_wait_us(max_wait_us)
+    {
+        for (int i = 0; i < max(1, workers); i++) {
+            replicas.emplace_back(factory());
+            replicas.back()->metrics = metrics;
+        }
+        input_shape = replicas[0]->shapes.front();
+        output_size = replicas[0]->shapes.back()[0] * replicas[0]->shapes.back()[1] * replicas[0]->shapes.back()[2];
+        totals.batch_sizes.assign(max_batch + 1, 0);
+        for (int i = 0; i < replicas.size(); i++) {
+            this->workers.emplace_back([this, i] { work(*replicas[i]); });
+        }
+        batcher = thread([this] { batch(); });
+    }
+
+    ~BatchServer()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stop = true;
+        }
+        cv.notify_all();
+        batcher.join();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    int input_size() { return input_shape[0] * input_shape[1] * input_shape[2]; }
+
+    // in holds input_size() floats in NCHW order
+    future<Mat> submit(const float* in)
+    {
+        unique_ptr<Request> request(new Request());
+        request->input = Mat(input_shape[0], input_shape[1] * input_shape[2]);
+        copy(in, in + input_size(), request->input[0]);
+        request->submitted = chrono::steady_clock::now();
+        future<Mat> result = request->result.get_future();
+        {
+            lock_guard<mutex> guard(lock);
+            queue.push_back(move(request));
+        }
+        cv.notify_all();
+        return result;
+    }
+
+    ServerStats stats()
+    {
+        lock_guard<mutex> guard(lock);
+        return totals;
+    }
+
+    void report(ostream& os)
+    {
+        ServerStats s = stats();
+        os << "requests: " << s.requests << ", batches: " << s.batches;
+        if (s.batches)
+            os << ", mean batch: " << (double)s.requests / s.batches;
+        os << '\n';
+        if (s.requests)
+            os << "queueing delay: mean " << s.queue_total_us / s.requests << " us, max " << s.queue_max_us << " us\n";
+        if (s.batches)
+            os << "service time: mean " << s.service_total_us / s.batches << " us per batch\n";
+        os << "batch sizes:";
+        for (int n = 1; n <= max_batch; n++) {
+            if (s.batch_sizes[n])
+                os << ' ' << n << 'x' << s.batch_sizes[n];
+        }
+        os << '\n';
+    }
+
+private:
+    void batch()
+    {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            cv.wait(guard, [this] { return stop || (idle > 0 && !queue.empty()); });
+            if (stop)
+                break;
+            auto deadline = queue.front()->submitted + chrono::microseconds(max_wait_us);
+            cv.wait_until(guard, deadline, [this] { return stop || queue.size() >= max_batch; });
+            if (stop)
+                break;
+            vector<unique_ptr<Request>> next;
+            while (!queue.empty() && next.size() < max_batch) {
+                next.push_back(move(queue.front()));
+                queue.pop_front();
+            }
+            batches.push_back(move(next));
+            idle--;
+            cv.notify_all();
+        }
+        // nobody will serve what is still queued
+        for (auto& request : queue) {
+            request->result.set_exception(make_exception_ptr(runtime_error("server stopped")));
+        }
+        queue.clear();
+    }
+
+    void work(Network& network)
+    {
+        unique_lock<mutex> guard(lock);
+        idle++;
+        cv.notify_all();
+        while (true) {
+            cv.wait(guard, [this] { return stop || !batches.empty(); });
+            if (batches.empty())
+                return;
+            vector<unique_ptr<Request>> current = move(batches.front());
+            batches.pop_front();
+            guard.unlock();
+            auto start = chrono::steady_clock::now();
+            for (auto& request : current) {
+                Mat out = network.forward(request->input);
+                metrics->request.record(chrono::steady_clock::now() - request->submitted);
+                request->result.set_value(move(out));
+            }
+            auto end = chrono::steady_clock::now();
+            guard.lock();
+            totals.requests += current.size();
+            totals.batches++;
+            totals.batch_sizes[current.size()]++;
+            for (auto& request : current) {
+                double queued = chrono::duration<double, micro>(start - request->submitted).count();
+                totals.queue_total_us += queued;
+                totals.queue_max_us = max(totals.queue_max_us, queued);
+            }
+            totals.service_total_us += chrono::duration<double, micro>(end - start).count();
+            idle++;
+            cv.notify_all();
+        }
+    }
+};
+
+#ifndef _WIN32
+static bool readFully(int fd, void* data, size_t size)
+{
+    for (size_t done = 0; done < size;) {
+        ssize_t n = read(fd, (char*)data + done, size - done);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// a peer that hung up fails with EPIPE instead of raising SIGPIPE: sockets are sent to with
+// MSG_NOSIGNAL, pipes rely on the caller having SIGPIPE blocked
+static bool writeFully(int fd, const void* data, size_t size)
+{
+    bool socket = true;
+    for (size_t done = 0; done < size;) {
+        ssize_t n = socket ? send(fd, (const char*)data + done, size - done, MSG_NOSIGNAL) : -1;
+        if (n < 0 && socket && errno == ENOTSOCK) {
+            socket = false;
+            continue;
+        }
+        if (!socket)
+            n = write(fd, (const char*)data + done, size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// one client on a pair of descriptors, in native byte order. a request is an int32 kind:
+//   0 followed by input_size() floats, answered with the int32 argmax and output_size floats
+//   1, answered with an int32 length and the stats report as text
+//   2, the same with the metrics in the Prometheus text format
+// requests are read and submitted as they arrive and answered in order, so a client may
+// pipeline as many as it likes. serveStream(server, 0, 1) serves a parent process over a pipe.
+// a client that hangs up, or a server that stops under it, ends the stream
+static void serveStream(BatchServer& server, int in_fd, int out_fd)
+{
+    struct Pending {
+        future<Mat> result;
+        string text;
+    };
+    mutex lock;
+    condition_variable cv;
+    deque<Pending> pending;
+    bool done = false, broken = false;
+    thread writer([&] {
+        sigset_t pipe;
+        sigemptyset(&pipe);
+        sigaddset(&pipe, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipe, nullptr); // a pending SIGPIPE dies with the thread
+        while (true) {
+            Pending next;
+            {
+                unique_lock<mutex> guard(lock);
+                cv.wait(guard, [&] { return done || !pending.empty(); });
+                if (pending.empty())
+                    return;
+                next = move(pending.front());
+                pending.pop_front();
+            }
+            bool ok = false;
+            if (next.result.valid()) {
+                try {
+                    Mat out = next.result.get();
+                    int32_t label = max_element(out[0], out[0] + server.output_size) - out[0];
+                    ok = writeFully(out_fd, &label, 4) && writeFully(out_fd, &*out[0], 4 * server.output_size);
+                } catch (const exception&) {
+                    // the server stopped before answering
+                }
+            } else {
+                int32_t length = next.text.size();
+                ok = writeFully(out_fd, &length, 4) && writeFully(out_fd, next.text.data(), length);
+            }
+            if (!ok) {
+                {
+                    lock_guard<mutex> guard(lock);
+                    broken = true;
+                    pending.clear();
+                }
+                shutdown(in_fd, SHUT_RD); // wakes the reader on a socket, pipes see it on the next request
+                return;
+            }
+        }
+    });
+    vector<float> input(server.input_size());
+    int32_t kind;
+    while (readFully(in_fd, &kind, 4)) {
+        Pending next;
+        if (kind == 0) {
+            if (!readFully(in_fd, input.data(), 4 * input.size()))
+                break;
+            next.result = server.submit(input.data());
+        } else if (kind == 1 || kind == 2) {
+            ostringstream text;
+            if (kind == 1)
+                server.report(text);
+            else
+                telemetry::writePrometheus(text, telemetry::snapshot(*server.metrics));
+            next.text = text.str();
+        } else {
+            break;
+        }
+        lock_guard<mutex> guard(lock);
+        if (broken)
+            break;
+        pending.push_back(move(next));
+        cv.notify_all();
+    }
+    {
+        lock_guard<mutex> guard(lock);
+        done = true;
+    }
+    cv.notify_all();
+    writer.join();
+}
+
+// accepts clients on a Unix domain socket at path, one thread each, until accept fails.
+// finished client threads are joined as new clients arrive
+static bool serveUnixSocket(BatchServer& server, string path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        close(fd);
+        return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str());
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        close(fd);
+        return false;
+    }
+    struct Client {
+        thread worker;
+        shared_ptr<atomic<bool>> finished;
+    };
+    vector<Client> clients;
+    while (true) {
+        int client = accept(fd, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (auto it = clients.begin(); it != clients.end();) {
+            if (*it->finished) {
+                it->worker.join();
+                it = clients.erase(it);
+            } else {
+                it++;
+            }
+        }
+        auto finished = make_shared<atomic<bool>>(false);
+        thread worker([&server, client, finished] {
+            serveStream(server, client, client);
+            close(client);
+            *finished = true;
+        });
+        clients.push_back({ move(worker), finished });
+    }
+    for (auto& client : clients) {
+        client.worker.join();
+    }
+    close(fd);
+    unlink(path.c_str());
+    return true;
+}
+#endif
+
+#endif
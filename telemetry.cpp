@@ -0,0 +1,240 @@
+#ifndef TELEMETRY_CPP
+#define TELEMETRY_CPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// production metrics, recorded with relaxed atomics only so forward and backward never take a
+// lock: HDR-style latency histograms of forward, backward, learn and end-to-end requests, and
+// counters of trained images, loss and correct predictions. snapshot() copies them out and
+// writePrometheus renders a snapshot in the Prometheus text format, as a scrape response or a
+// file for node_exporter's textfile collector
+namespace telemetry {
+
+// log-linear buckets over nanoseconds: 2^sub_bits buckets per power of two, so every value is
+// stored within 1 / 2^sub_bits of itself, from 1 ns up to 2^max_bits ns (about 18 minutes)
+class Histogram {
+public:
+    static const int sub_bits = 4, sub_count = 1 << sub_bits, max_bits = 40;
+    static const int buckets = (max_bits - sub_bits + 1) * sub_count;
+
+private:
+    atomic<uint64_t> counts[buckets];
+    atomic<uint64_t> total { 0 }, sum { 0 }, largest { 0 };
+
+public:
+    Histogram()
+    {
+        for (auto& count : counts) {
+            count.store(0, memory_order_relaxed);
+        }
+    }
+
+    static int bucket(uint64_t ns)
+    {
+        ns = min<uint64_t>(ns, (1ull << max_bits) - 1);
+        if (ns < sub_count)
+            return ns;
+        int shift = 63 - __builtin_clzll(ns) - sub_bits;
+        return (shift + 1) * sub_count + ((ns >> shift) & (sub_count - 1));
+    }
+
+    // midpoint of the values stored in bucket i
+    static double value(int i)
+    {
+        if (i < sub_count)
+            return i;
+        int shift = i / sub_count - 1;
+        uint64_t low = (uint64_t)(sub_count + i % sub_count) << shift;
+        return low + ((1ull << shift) - 1) / 2.0;
+    }
+
+    void record(uint64_t ns)
+    {
+        counts[bucket(ns)].fetch_add(1, memory_order_relaxed);
+        total.fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(ns, memory_order_relaxed);
+        uint64_t current = largest.load(memory_order_relaxed);
+        while (ns > current && !largest.compare_exchange_weak(current, ns, memory_order_relaxed)) {
+        }
+    }
+
+    void record(chrono::steady_clock::duration elapsed)
+    {
+        record(max<int64_t>(0, chrono::duration_cast<chrono::nanoseconds>(elapsed).count()));
+    }
+
+    uint64_t count() const { return total.load(memory_order_relaxed); }
+    uint64_t sum_ns() const { return sum.load(memory_order_relaxed); }
+    uint64_t max_ns() const { return largest.load(memory_order_relaxed); }
+
+    vector<uint64_t> bins() const
+    {
+        vector<uint64_t> res(buckets);
+        for (int i = 0; i < buckets; i++) {
+            res[i] = counts[i].load(memory_order_relaxed);
+        }
+        return res;
+    }
+
+    void reset()
+    {
+        for (auto& count : counts) {
+            count.store(0, memory_order_relaxed);
+        }
+        total = 0, sum = 0, largest = 0;
+    }
+};
+
+// times the enclosing block into a histogram
+class Timer {
+    Histogram& histogram;
+    chrono::steady_clock::time_point start;
+
+public:
+    Timer(Histogram& histogram)
+        : histogram(histogram)
+        , start(chrono::steady_clock::now())
+    {
+    }
+
+    ~Timer()
+    {
+        histogram.record(chrono::steady_clock::now() - start);
+    }
+};
+
+// plain copy of a histogram with its quantiles in seconds
+struct Summary {
+    uint64_t count = 0;
+    double sum = 0, max = 0;
+    vector<pair<double, double>> quantiles; // (q, seconds)
+};
+
+static Summary summarize(const Histogram& h, vector<double> qs = { 0.5, 0.9, 0.99, 0.999 })
+{
+    Summary s;
+    vector<uint64_t> bins = h.bins();
+    for (uint64_t n : bins) {
+        s.count += n; // bins rather than count(), a concurrent record may be half done
+    }
+    s.sum = h.sum_ns() * 1e-9;
+    s.max = h.max_ns() * 1e-9;
+    for (double q : qs) {
+        uint64_t rank = min<uint64_t>(s.count, (uint64_t)(q * s.count) + 1), seen = 0;
+        double v = 0;
+        for (int i = 0; i < Histogram::buckets && s.count; i++) {
+            seen += bins[i];
+            if (seen >= rank) {
+                v = min(Histogram::value(i) * 1e-9, s.max);
+                break;
+            }
+        }
+        s.quantiles.push_back({ q, v });
+    }
+    return s;
+}
+
+// kept by Network, shared by copies of it and by the replicas of a BatchServer
+struct Metrics {
+    Histogram forward, backward, learn, request;
+    atomic<uint64_t> images { 0 }, correct { 0 };
+    atomic<uint64_t> loss_micro { 0 }; // summed squared error, in millionths so it stays an integer
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+    // one trained sample, its squared error and whether the argmax matched the answer
+    void sample(double loss, bool hit)
+    {
+        images.fetch_add(1, memory_order_relaxed);
+        if (loss >= 0 && loss < 1e12) // a diverged sample would wrap the counter
+            loss_micro.fetch_add((uint64_t)(loss * 1e6 + 0.5), memory_order_relaxed);
+        if (hit)
+            correct.fetch_add(1, memory_order_relaxed);
+    }
+};
+
+struct Snapshot {
+    double seconds = 0; // since the metrics were created
+    Summary forward, backward, learn, request;
+    uint64_t images = 0, correct = 0;
+    double loss = 0;
+};
+
+static Snapshot snapshot(const Metrics& m)
+{
+    Snapshot s;
+    s.seconds = chrono::duration<double>(chrono::steady_clock::now() - m.started).count();
+    s.forward = summarize(m.forward);
+    s.backward = summarize(m.backward);
+    s.learn = summarize(m.learn);
+    s.request = summarize(m.request);
+    s.images = m.images.load(memory_order_relaxed);
+    s.correct = m.correct.load(memory_order_relaxed);
+    s.loss = m.loss_micro.load(memory_order_relaxed) * 1e-6;
+    return s;
+}
+
+// counters and summaries as they are, plus images/s, loss and accuracy over the window since
+// previous, or since the start without one
+static void writePrometheus(ostream& os, const Snapshot& now, const Snapshot* previous = nullptr, string prefix = "cppnn")
+{
+    os << setprecision(9);
+    auto summary = [&](string name, string help, const Summary& s) {
+        name = prefix + "_" + name + "_seconds";
+        os << "# HELP " << name << ' ' << help << '\n'
+           << "# TYPE " << name << " summary\n";
+        for (auto& q : s.quantiles) {
+            os << name << "{quantile=\"" << q.first << "\"} " << q.second << '\n';
+        }
+        os << name << "_sum " << s.sum << '\n'
+           << name << "_count " << s.count << '\n';
+    };
+    auto metric = [&](string name, string type, string help, double value) {
+        name = prefix + "_" + name;
+        os << "# HELP " << name << ' ' << help << '\n'
+           << "# TYPE " << name << ' ' << type << '\n'
+           << name << ' ' << value << '\n';
+    };
+    summary("forward", "Latency of Network::forward.", now.forward);
+    summary("backward", "Latency of Network::backPropagation.", now.backward);
+    summary("learn", "Latency of applying a batch of gradients.", now.learn);
+    summary("request", "End-to-end latency of served requests, queueing included.", now.request);
+    metric("train_images_total", "counter", "Trained images.", now.images);
+    metric("train_correct_total", "counter", "Trained images whose prediction matched the answer.", now.correct);
+    metric("train_loss_sum", "counter", "Summed squared error of trained images.", now.loss);
+
+    Snapshot start;
+    const Snapshot& before = previous ? *previous : start;
+    double seconds = now.seconds - before.seconds;
+    uint64_t images = now.images - before.images;
+    metric("train_images_per_second", "gauge", "Training throughput over the last window.", seconds > 0 ? images / seconds : 0);
+    metric("train_loss", "gauge", "Mean squared error per image over the last window.", images ? (now.loss - before.loss) / images : 0);
+    metric("train_accuracy", "gauge", "Accuracy of training predictions over the last window.", images ? (double)(now.correct - before.correct) / images : 0);
+}
+
+// writes next to path and renames, so a scraper never reads half a file
+static bool writePrometheusFile(string path, const Snapshot& now, const Snapshot* previous = nullptr)
+{
+    string temp = path + ".tmp";
+    {
+        ofstream fout(temp);
+        writePrometheus(fout, now, previous);
+        if (!fout)
+            return false;
+    }
+    return rename(temp.c_str(), path.c_str()) == 0;
+}
+
+}
+
+#endif
@@ -0,0 +1,335 @@
+#ifndef THREADPOOL_CPP
+#define THREADPOOL_CPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+namespace pool {
+
+// cpus we may run on, grouped by NUMA node in ascending order
+struct Cpu {
+    int id, node;
+};
+
+#ifdef __linux__
+// parses a sysfs cpulist such as "0-3,8-11"
+static vector<int> parse_cpulist(string list)
+{
+    vector<int> res;
+    stringstream ss(list);
+    string range;
+    while (getline(ss, range, ',')) {
+        if (range.empty())
+            continue;
+        size_t dash = range.find('-');
+        int first = stoi(range.substr(0, dash));
+        int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+        for (int i = first; i <= last; i++) {
+            res.push_back(i);
+        }
+    }
+    return res;
+}
+#endif
+
+static vector<Cpu> topology()
+{
+    vector<Cpu> cpus;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    vector<int> node_of(CPU_SETSIZE, 0);
+    for (int node = 0;; node++) {
+        ifstream fin("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        string list;
+        if (!fin || !getline(fin, list))
+            break;
+        for (int cpu : parse_cpulist(list)) {
+            if (cpu < CPU_SETSIZE)
+                node_of[cpu] = node;
+        }
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed))
+            cpus.push_back({ cpu, node_of[cpu] });
+    }
+    stable_sort(cpus.begin(), cpus.end(), [](const Cpu& a, const Cpu& b) { return a.node < b.node; });
+#endif
+    if (cpus.empty()) {
+        for (int cpu = 0; cpu < (int)max(1u, thread::hardware_concurrency()); cpu++) {
+            cpus.push_back({ cpu, 0 });
+        }
+    }
+    return cpus;
+}
+
+// process-wide pool for intra-op parallelism. parallel_for hands every participant a
+// contiguous share of the range, a participant that runs dry steals the upper half of
+// another's remainder, trying the workers on its own NUMA node first. the calling thread
+// takes part, so a pool of n threads runs n - 1 workers. calls from inside a worker or
+// while another thread owns the pool run inline, so kernels never oversubscribe cores
+// when the caller is itself one of several data-parallel training threads
+class ThreadPool {
+    struct Share {
+        mutex lock;
+        long begin = 0, end = 0;
+    };
+
+    vector<thread> workers;
+    vector<Cpu> placement; // cpu and node of participant i, the caller is participant 0
+    vector<unique_ptr<Share>> shares;
+    vector<vector<int>> victims; // steal order of participant i
+    mutex owner; // held by the thread running a parallel_for
+    mutex lock;
+    condition_variable cv;
+    function<void(long, long)> job;
+    long grain = 1;
+    long generation = 0;
+    int active = 0;
+    atomic<long> remaining { 0 };
+    atomic<bool> failed { false }; // a subrange threw, the rest is abandoned
+    exception_ptr error;
+    bool stop = false;
+
+public:
+    const int threads;
+    const bool pinned;
+
+    // threads = 0 uses every cpu we may run on, pin binds worker i to the i-th of those cpus
+    ThreadPool(int threads = 0, bool pin = false)
+        : threads(threads > 0 ? threads : topology().size())
+        , pinned(pin)
+    {
+        vector<Cpu> cpus = topology();
+        for (int i = 0; i < this->threads; i++) {
+            placement.push_back(cpus[i % cpus.size()]);
+            shares.emplace_back(new Share());
+        }
+        for (int i = 0; i < this->threads; i++) {
+            vector<int> order;
+            for (int d = 1; d < this->threads; d++) {
+                order.push_back((i + d) % this->threads);
+            }
+            stable_partition(order.begin(), order.end(), [&](int v) { return placement[v].node == placement[i].node; });
+            victims.push_back(order);
+        }
+        for (int i = 1; i < this->threads; i++) {
+            workers.emplace_back([this, i] { run(i); });
+#ifdef __linux__
+            if (pinned) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(placement[i].id, &set);
+                pthread_setaffinity_np(workers.back().native_handle(), sizeof(set), &set);
+            }
+#endif
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // calls f(lo, hi) on disjoint subranges covering [begin, end), none shorter than
+    // grain except the last. returns once every subrange is done. if f throws, the
+    // subranges not yet started are skipped and the first exception is rethrown once
+    // every participant has stopped
+    void parallel_for(long begin, long end, long grain, function<void(long, long)> f)
+    {
+        grain = max(1L, grain);
+        unique_lock<mutex> owned(owner, defer_lock);
+        if (end - begin <= grain || threads == 1 || inside() || !owned.try_lock()) {
+            if (begin < end)
+                f(begin, end);
+            return;
+        }
+        long chunks = (end - begin + grain - 1) / grain;
+        int used = min<long>(threads, chunks);
+        for (int i = 0; i < threads; i++) {
+            long lo = i < used ? begin + chunks * i / used * grain : end;
+            long hi = i + 1 < used ? begin + chunks * (i + 1) / used * grain : end;
+            shares[i]->begin = lo, shares[i]->end = hi;
+        }
+        remaining = end - begin;
+        failed = false;
+        {
+            lock_guard<mutex> guard(lock);
+            error = nullptr;
+            job = f;
+            this->grain = grain;
+            generation++;
+            active = threads - 1;
+        }
+        cv.notify_all();
+        inside() = true;
+        work(0);
+        inside() = false;
+        exception_ptr thrown;
+        {
+            unique_lock<mutex> guard(lock);
+            cv.wait(guard, [this] { return active == 0; });
+            job = nullptr;
+            thrown = error;
+            error = nullptr;
+        }
+        if (thrown)
+            rethrow_exception(thrown);
+    }
+
+    // true on workers and on the caller while it runs its share of a parallel_for
+    static bool& inside()
+    {
+        thread_local bool flag = false;
+        return flag;
+    }
+
+    // index of the calling thread among the participants, 0 for any thread outside the pool.
+    // no two threads share an index while a parallel_for runs, so kernels can keep one
+    // scratch row per participant
+    static int& participant()
+    {
+        thread_local int id = 0;
+        return id;
+    }
+
+private:
+    void run(int id)
+    {
+        inside() = true;
+        participant() = id;
+        long seen = 0;
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            cv.wait(guard, [&] { return stop || generation != seen; });
+            if (stop)
+                return;
+            seen = generation;
+            guard.unlock();
+            work(id);
+            guard.lock();
+            if (--active == 0)
+                cv.notify_all();
+        }
+    }
+
+    // drains our own share front to back, then steals until nothing is left. exceptions
+    // are kept for the caller, they mustn't unwind a worker or leave the others running
+    void work(int id)
+    {
+        Share& own = *shares[id];
+        while (remaining > 0 && !failed) {
+            long lo, hi;
+            {
+                lock_guard<mutex> guard(own.lock);
+                lo = own.begin;
+                hi = min(own.end, lo + grain);
+                own.begin = hi;
+            }
+            if (lo < hi) {
+                try {
+                    job(lo, hi);
+                } catch (...) {
+                    lock_guard<mutex> guard(lock);
+                    if (!error)
+                        error = current_exception();
+                    failed = true;
+                }
+                remaining -= hi - lo;
+            } else if (!steal(id)) {
+                this_thread::yield();
+            }
+        }
+    }
+
+    bool steal(int id)
+    {
+        for (int v : victims[id]) {
+            Share& victim = *shares[v];
+            long lo, hi;
+            {
+                lock_guard<mutex> guard(victim.lock);
+                long left = victim.end - victim.begin;
+                if (left <= 0)
+                    continue;
+                // the victim keeps at least its current chunk
+                long keep = max(grain, (left / grain + 1) / 2 * grain);
+                if (left <= keep)
+                    continue;
+                lo = victim.begin + keep;
+                hi = victim.end;
+                victim.end = lo;
+            }
+            Share& own = *shares[id];
+            lock_guard<mutex> guard(own.lock);
+            own.begin = lo;
+            own.end = hi;
+            return true;
+        }
+        return false;
+    }
+};
+
+static unique_ptr<ThreadPool>& instance()
+{
+    static unique_ptr<ThreadPool> pool(new ThreadPool());
+    return pool;
+}
+
+// replaces the shared pool, must not be called while a kernel is running
+static void configure(int threads, bool pin = false)
+{
+    instance().reset();
+    instance().reset(new ThreadPool(threads, pin));
+}
+
+static int threads()
+{
+    return instance()->threads;
+}
+
+static bool in_parallel()
+{
+    return ThreadPool::inside();
+}
+
+// row of the calling thread in per-participant scratch of threads() rows
+static int participant()
+{
+    return ThreadPool::participant();
+}
+
+// f is passed on by reference, so large captures don't cost a heap allocation per call
+template <class F>
+static void parallel_for(long begin, long end, long grain, F&& f)
+{
+    instance()->parallel_for(begin, end, grain, [&f](long lo, long hi) { f(lo, hi); });
+}
+
+}
+
+#endif